@@ -30,6 +30,10 @@
 #include <fstream>
 #include <vector>
 #include <utility>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <cstdint>
 #include <assert.h>
 
 #define _USE_MATH_DEFINES
@@ -126,6 +130,210 @@ namespace Raveler
                   const int oversample,
                   vector<vector<int>> &lines);
 
+  enum
+  layout_type
+  {
+    ROW_MAJOR,
+    TILED,
+    MORTON
+  };
+
+  /*
+  * Storage order of the residual image. ROW_MAJOR keeps the
+  * plain res*j + i indexing. TILED and MORTON store only the
+  * pixels a thread can ever reach (those inside the circle of
+  * pins), ordered by 8x8 tiles or along a Z-order curve so
+  * that neighbouring pixels of a chord share cache lines and
+  * pages.
+  *
+  * Members:
+  *   size: Number of stored pixels
+  *   index: Row-major loc to stored index, or -1 for pixels
+  *          outside the circle (empty for ROW_MAJOR)
+  */
+  struct
+  pixel_layout
+  {
+    int res;
+    layout_type type;
+    int size;
+    vector<int> index;
+  };
+
+  void
+  make_layout(const int res,
+              const layout_type type,
+              pixel_layout &layout);
+
+  /*
+  * Copy a row-major image into the storage order of layout.
+  */
+  void
+  to_layout(const vector<double> &image,
+            const pixel_layout &layout,
+            vector<double> &stored);
+
+  /*
+  * Like fill_line_masks above, but with pixel indices in the
+  * storage order of layout. Each mask is sorted so that a
+  * scan through it walks memory front to back.
+  */
+  void
+  fill_line_masks(const int k,
+                  const int res,
+                  const int oversample,
+                  const pixel_layout &layout,
+                  vector<vector<int>> &lines);
+
+  enum
+  mask_symmetry
+  {
+    ROTATE,
+    GRID
+  };
+
+  /*
+  * Line masks stored once per symmetry class instead of once
+  * per pair of pins. All pins sit on a circle, so the line
+  * from pin a to pin b is the line from pin 0 to pin b-a,
+  * rotated by a*2pi/k.
+  *
+  * ROTATE keeps one template per pin offset (k/2+1 of them)
+  * as pixel centres relative to the middle of the image, and
+  * rotates them onto the pixel grid whenever a line is
+  * needed. The result is approximate; see compare_masks.
+  *
+  * GRID requires k divisible by 4 and only uses quarter
+  * turns (and mirror images when k is divisible by 8), which
+  * are symmetries of the pixel grid, so no resampling is
+  * involved. It keeps the direct get_line output for pins
+  * a < k/4 (or a <= k/8). The other lines are still not those
+  * of get_line, whose rounding is not symmetric under these
+  * maps: at k=200, res=300 fewer than half of them match. See
+  * compare_masks.
+  *
+  * Members:
+  *   fold: Number of symmetric copies of each stored line
+  *   offsets: Start of each stored line within points
+  *            (one extra entry marks the end of the last)
+  *   points: Pairs of (u,v) pixel centre offsets (ROTATE)
+  *   locs: Row-major pixel locations (GRID)
+  *   cos_pin, sin_pin: Rotation to each pin (ROTATE only)
+  */
+  struct
+  compressed_masks
+  {
+    int k;
+    int res;
+    int oversample;
+    mask_symmetry symmetry;
+    int fold;
+    int max_length;
+    vector<int> offsets;
+    vector<float> points;
+    vector<int> locs;
+    vector<double> cos_pin;
+    vector<double> sin_pin;
+  };
+
+  /*
+  * Build compressed line masks. Returns 0 on success, or 1 if
+  * GRID symmetry was requested but k is not divisible by 4.
+  */
+  int
+  fill_compressed_masks(const int k,
+                        const int res,
+                        const int oversample,
+                        const mask_symmetry symmetry,
+                        compressed_masks &masks);
+
+  /*
+  * Regenerate the pixel mask of the line from pin a to pin b
+  * into buffer (terminated by -1, as in fill_line_masks).
+  * buffer needs room for masks.max_length+1 entries.
+  *
+  * Returns:
+  *   Length of line, measured in pixels.
+  */
+  int
+  expand_line(const compressed_masks &masks,
+              const int a,
+              const int b,
+              int *buffer);
+
+  /*
+  * Memory held by a table from fill_line_masks, and by a set
+  * of compressed masks, in bytes.
+  */
+  size_t
+  mask_bytes(const vector<vector<int>> &lines);
+
+  size_t
+  mask_bytes(const compressed_masks &masks);
+
+  /*
+  * How far expanded lines deviate from direct get_line
+  * output, over all pairs of pins.
+  *
+  * Members:
+  *   identical: Fraction of lines with exactly the same pixels
+  *   overlap: Mean Jaccard index of the pixel sets
+  *   adjacent: Fraction of expanded pixels that lie on or
+  *             next to the direct line
+  *   length_error: Mean absolute difference in line length
+  */
+  struct
+  mask_deviation
+  {
+    double identical;
+    double overlap;
+    double adjacent;
+    double length_error;
+  };
+
+  void
+  compare_masks(const compressed_masks &masks,
+                mask_deviation &deviation);
+
+  /*
+  * For whatever reason, the visual effect of a strand of
+  * thread crossing any particular region seems to be lower
+  * than what you'd predict. This 0.7 scale factor seems
+  * to produce output that looks roughly true to reality.
+  */
+  inline
+  double
+  get_visual_weight(const double weight)
+    {
+      return 0.7 * weight;
+    }
+
+  /*
+  * Settings for fast, approximate "draft" ravels. Instead of
+  * scoring every pin at each step, only a random subset is
+  * scored, plus the best few candidates of the previous step.
+  * Runs with the same seed are reproducible.
+  *
+  * Members:
+  *   fraction: Share of the k pins sampled at each step
+  *   stratified: Draw one pin from each of fraction*k equal
+  *               arcs of the circle, rather than uniformly
+  *   seed: Random seed
+  *   keep_top: Number of the previous step's best pins that
+  *             are always scored again
+  *   exhaustive_tail: Score every pin for this many final
+  *                    lines, to refine the end of the path
+  */
+  struct
+  draft_options
+  {
+    double fraction = 0.25;
+    bool stratified = false;
+    unsigned int seed = 0;
+    int keep_top = 4;
+    int exhaustive_tail = 0;
+  };
+
   double
   get_score(const int a,
             const int b,
@@ -143,8 +351,555 @@ namespace Raveler
             vector<int> &path,
             vector<double> &scores);
 
+  /*
+  * As above, but only scoring a sample of the candidate pins
+  * at each step, as configured by draft.
+  */
+  void
+  do_ravel( const vector<double> &img,
+            const double weight,
+            const int k,
+            const int N,
+            const vector<vector<int>> &lines,
+            const draft_options &draft,
+            vector<int> &path,
+            vector<double> &scores);
+
+  /*
+  * As above, regenerating each line from compressed masks as
+  * it is scored.
+  */
+  void
+  do_ravel( const vector<double> &img,
+            const double weight,
+            const int k,
+            const int N,
+            const compressed_masks &masks,
+            vector<int> &path,
+            vector<double> &scores);
+
+  /*
+  * Everything needed to pick a ravel up where it left off:
+  * the parameters it was started with, the residual image
+  * and the path laid so far. path holds one more entry than
+  * scores (the starting pin).
+  *
+  * weight is the relative weight the ravel runs with. The
+  * physical thread weight, frame size and thread color are
+  * not used while raveling, but are kept so that a resumed
+  * design is written out as it was started. A frame_size of 0
+  * means they are unknown (states saved by older versions).
+  */
+  struct
+  ravel_state
+  {
+    int k;
+    int res;
+    int oversample;
+    layout_type layout;
+    double weight;
+    double thread_weight;
+    double frame_size;
+    bool white_thread;
+    vector<double> residual;
+    vector<int> path;
+    vector<double> scores;
+  };
+
+  /*
+  * Prepare a fresh ravel_state for image, as do_ravel would
+  * start from. The image must already be in the storage
+  * order of the given layout.
+  */
+  void
+  init_state(const vector<double> &image,
+             const double weight,
+             const int k,
+             const int res,
+             const int oversample,
+             ravel_state &state,
+             const layout_type layout = ROW_MAJOR);
+
+  /*
+  * Continue a ravel until its path holds N lines. The result
+  * is identical to a single uninterrupted do_ravel to N.
+  *
+  * Arguments:
+  *   state: Ravel to be extended in place
+  *   N: Total number of lines wanted
+  *   lines: Pixel masks for state.k and state.res
+  *   checkpoint_every: If > 0, call checkpoint with a copy of
+  *                     the state after every so many lines
+  *   checkpoint: Callback for intermediate states (optional)
+  */
+  void
+  resume_ravel(ravel_state &state,
+               const int N,
+               const vector<vector<int>> &lines,
+               const int checkpoint_every = 0,
+               const function<void(const ravel_state&)> &checkpoint = nullptr);
+
+  void
+  resume_ravel(ravel_state &state,
+               const int N,
+               const compressed_masks &masks,
+               const int checkpoint_every = 0,
+               const function<void(const ravel_state&)> &checkpoint = nullptr);
+
+  /*
+  * As above, as a draft ravel. The random sequence restarts
+  * from draft.seed with every call.
+  */
+  void
+  resume_ravel(ravel_state &state,
+               const int N,
+               const vector<vector<int>> &lines,
+               const draft_options &draft,
+               const int checkpoint_every = 0,
+               const function<void(const ravel_state&)> &checkpoint = nullptr);
+
+  /*
+  * Line masks stored back to back in a single array rather
+  * than one max-length vector per pair of pins. Line a-b
+  * starts at locs[offsets[a*k + b]] and is terminated by -1,
+  * so the lines from one pin are adjacent in memory. The
+  * pixels are exactly those of fill_line_masks for the same
+  * layout, so raveling with either gives the same path, but
+  * these take less memory and are faster to scan.
+  */
+  struct
+  flat_masks
+  {
+    int k;
+    int res;
+    int oversample;
+    layout_type layout;
+    vector<int> offsets;
+    vector<int> locs;
+  };
+
+  void
+  fill_flat_masks(const int k,
+                  const int res,
+                  const int oversample,
+                  flat_masks &masks);
+
+  void
+  fill_flat_masks(const int k,
+                  const int res,
+                  const int oversample,
+                  const pixel_layout &layout,
+                  flat_masks &masks);
+
+  size_t
+  mask_bytes(const flat_masks &masks);
+
+  /*
+  * do_ravel and resume_ravel over flat masks.
+  */
+  void
+  do_ravel( const vector<double> &img,
+            const double weight,
+            const int k,
+            const int N,
+            const flat_masks &masks,
+            vector<int> &path,
+            vector<double> &scores);
+
+  void
+  resume_ravel(ravel_state &state,
+               const int N,
+               const flat_masks &masks,
+               const int checkpoint_every = 0,
+               const function<void(const ravel_state&)> &checkpoint = nullptr);
+
+  void
+  resume_ravel(ravel_state &state,
+               const int N,
+               const flat_masks &masks,
+               const draft_options &draft,
+               const int checkpoint_every = 0,
+               const function<void(const ravel_state&)> &checkpoint = nullptr);
+
+  /*
+  * Save flat masks so that later runs can load them instead
+  * of building them, after the configuration they were built
+  * for. Returns 0 on success.
+  */
+  int
+  write_mask_cache(ostream &out,
+                   const flat_masks &masks);
+
+  /*
+  * Load masks written by write_mask_cache. Returns non-zero,
+  * leaving masks untouched, if the cache can't be read or was
+  * made for another configuration.
+  */
+  int
+  read_mask_cache(istream &in,
+                  const int k,
+                  const int res,
+                  const int oversample,
+                  const layout_type layout,
+                  flat_masks &masks);
+
+  /*
+  * Warm start a fresh state from an earlier path, such as
+  * the previous frame of an animation. Lines of the previous
+  * path are replayed against the state's residual, in order,
+  * for as long as each one still scores at least tolerance
+  * times what it scored before. A later call to resume_ravel
+  * continues greedily from where this stops.
+  *
+  * Returns:
+  *   Number of lines kept.
+  */
+  int
+  replay_prefix(ravel_state &state,
+                const ravel_state &previous,
+                const vector<vector<int>> &lines,
+                const double tolerance = 0.9);
+
+  int
+  replay_prefix(ravel_state &state,
+                const ravel_state &previous,
+                const flat_masks &masks,
+                const double tolerance = 0.9);
+
+  /*
+  * Serialize a ravel_state in a compact binary format (host
+  * byte order). Both return 0 on success. read_state rejects
+  * headers, sizes or pins that do not describe a valid state,
+  * and leaves state untouched when it fails.
+  */
+  int
+  write_state(ostream &out,
+              const ravel_state &state);
+
+  int
+  read_state(istream &in,
+             ravel_state &state);
+
+  /*
+  * Binary design format. A 40 byte little-endian header
+  *
+  *   char     magic[4]    "RAVD"
+  *   uint16   version
+  *   uint8    pin_encoding
+  *   uint8    score_encoding
+  *   uint32   k, n_pins, n_scores, pin_bytes, flags
+  *   float32  frame_size, weight, length
+  *
+  * is followed by pin_bytes of pins, zero padded to a
+  * multiple of 4 bytes, and then n_scores scores. Bit 0 of
+  * flags marks white thread.
+  */
+  enum
+  pin_encoding
+  {
+    PINS_UINT16,  // one uint16 per pin, random access
+    PINS_VARINT   // zigzag varint deltas (see write_binary_design)
+  };
+
+  enum
+  score_encoding
+  {
+    NO_SCORES,
+    SCORES_FLOAT16,
+    SCORES_FLOAT32
+  };
+
+  /*
+  * A parsed design, pointing into the buffer it was parsed
+  * from. Nothing is copied, so the buffer must outlive it.
+  */
+  struct
+  design_view
+  {
+    int version;
+    int k;
+    int n_pins;
+    int n_scores;
+    double frame_size;
+    double weight;
+    double length;
+    bool white_thread;
+    pin_encoding pins;
+    score_encoding scores;
+    const unsigned char *pin_data;
+    size_t pin_bytes;
+    const unsigned char *score_data;
+  };
+
+  /*
+  * Write a design in the binary format. Pins are stored as
+  * varint deltas whenever that is smaller than plain uint16s,
+  * which it nearly always is: each delta is taken from the
+  * pin opposite the previous one, and greedy paths mostly
+  * cross the frame, so most deltas fit in a single byte.
+  *
+  * Returns 0 on success.
+  */
+  int
+  write_binary_design(ostream &out,
+                      const vector<int> &path,
+                      const vector<double> &scores,
+                      const int k,
+                      const double frame_size,
+                      const double weight,
+                      const bool white_thread,
+                      const score_encoding encoding = SCORES_FLOAT16);
+
+  /*
+  * Check the header of a binary design held in memory and
+  * fill in a view of it. Returns 0 on success.
+  */
+  int
+  parse_binary_design(const void *data,
+                      const size_t size,
+                      design_view &view);
+
+  /*
+  * Unpack the pins of a design. Returns 0 on success, or
+  * non-zero if the pin data is corrupt.
+  */
+  int
+  decode_pins(const design_view &view,
+              vector<int> &path);
+
+  /*
+  * Score of line i (0 <= i < view.n_scores), read straight
+  * from the view's buffer.
+  */
+  double
+  get_design_score(const design_view &view,
+                   const int i);
+
+  /*
+  * A binary design file mapped read-only into memory.
+  */
+  class
+  MappedDesign
+  {
+    public:
+      MappedDesign();
+      ~MappedDesign();
+
+      MappedDesign(const MappedDesign&) = delete;
+      MappedDesign &operator=(const MappedDesign&) = delete;
+
+      /*
+      * Map and parse fname. Returns 0 on success.
+      */
+      int
+      open(const string &fname);
+
+      void
+      close();
+
+      const design_view &
+      view() const
+        {
+          return parsed;
+        }
+
+    private:
+      void *base;
+      size_t size;
+      design_view parsed;
+  };
+
+  enum
+  channel_ordering
+  {
+    INDEPENDENT,
+    INTERLEAVED
+  };
+
+  /*
+  * A single thread segment from pin a to pin b, drawn in
+  * the colour of the given channel.
+  */
+  struct
+  segment
+  {
+    int a;
+    int b;
+    int channel;
+    double score;
+  };
+
+  /*
+  * Score the line between pins a and b for every channel at
+  * once. The residual holds all channels interleaved (i.e.
+  * pixel loc of channel c lives at loc*channels + c), so a
+  * single traversal of the line mask gathers all of them.
+  *
+  * Arguments:
+  *   weights: Visual weight of each channel's thread
+  *   scores: Filled with one score per channel
+  */
+  void
+  get_channel_scores(const int a,
+                     const int b,
+                     const int k,
+                     const int channels,
+                     const vector<double> &weights,
+                     const vector<double> &residual,
+                     const vector<vector<int>> &lines,
+                     double *scores);
+
+  /*
+  * Ravel several thread colours against one shared set of
+  * line masks. Each channel has its own residual image.
+  *
+  * With INDEPENDENT ordering each channel is a continuous
+  * path of its own with N segments. Since the channels
+  * never interact, this is a monochrome ravel per channel;
+  * the segments are returned taking turns between channels.
+  *
+  * With INTERLEAVED ordering all channels share a single
+  * continuous path of N segments, and each segment is drawn
+  * in whichever colour scores best. The residuals are
+  * stored interleaved so that one gather per candidate line
+  * scores every channel at once.
+  *
+  * Arguments:
+  *   images: One source image per channel
+  *   weights: Relative thread weight of each channel
+  *   segments: Filled with the segments in the order laid
+  */
+  void
+  do_ravel_channels(const vector<vector<double>> &images,
+                    const vector<double> &weights,
+                    const int k,
+                    const int N,
+                    const vector<vector<int>> &lines,
+                    const channel_ordering ordering,
+                    vector<segment> &segments);
+
+  /*
+  * Root-mean-square value of a residual image. Lower is a
+  * closer reconstruction of the source image.
+  */
+  double
+  get_error(const vector<double> &residual);
+
   double
   get_length(const vector<int> &path,
             const int k,
             const double frame_size);
+
+  /*
+  * Line masks for one configuration, built once and never
+  * modified afterwards, so any number of threads may read
+  * them at the same time.
+  */
+  struct
+  mask_set
+  {
+    int k;
+    int res;
+    int oversample;
+    pixel_layout layout;
+    flat_masks lines;
+  };
+
+  class Session;
+
+  /*
+  * Owns the line masks for one configuration and hands out
+  * independent ravel sessions that share them. An Engine is
+  * immutable once constructed; Sessions keep the masks alive
+  * through a shared pointer, so they may outlive it.
+  */
+  class
+  Engine
+  {
+    public:
+      Engine(const int k,
+             const int res,
+             const int oversample = 1,
+             const layout_type layout = ROW_MAJOR);
+
+      /*
+      * Begin a new ravel of a row-major res x res image.
+      * Returns nullptr if the image has the wrong size.
+      */
+      unique_ptr<Session>
+      start(const vector<double> &image,
+            const double weight) const;
+
+      /*
+      * As above, warm started from a previous path (see
+      * replay_prefix).
+      */
+      unique_ptr<Session>
+      start(const vector<double> &image,
+            const double weight,
+            const ravel_state &previous,
+            const double tolerance = 0.9) const;
+
+      /*
+      * Continue a saved ravel. Returns nullptr if the state
+      * was made with a different configuration.
+      */
+      unique_ptr<Session>
+      resume(const ravel_state &state) const;
+
+      const shared_ptr<const mask_set> masks;
+  };
+
+  /*
+  * A single ravel job. Each session owns its residual, path
+  * and scores, which are sized once per run so that the
+  * greedy loop never allocates. A session is used by one
+  * thread at a time, except for cancel(), which may be
+  * called from anywhere.
+  */
+  class
+  Session
+  {
+    public:
+      /*
+      * Ravel until the path holds N lines. Same arguments as
+      * resume_ravel. Returns false if cancelled first, in
+      * which case state() holds the lines laid so far.
+      */
+      bool
+      run(const int N,
+          const int checkpoint_every = 0,
+          const function<void(const ravel_state&)> &checkpoint = nullptr);
+
+      /*
+      * As above, as a draft ravel (see draft_options).
+      */
+      bool
+      run(const int N,
+          const draft_options &draft,
+          const int checkpoint_every = 0,
+          const function<void(const ravel_state&)> &checkpoint = nullptr);
+
+      /*
+      * Ask a running (or future) run() to stop after the
+      * current line.
+      */
+      void
+      cancel();
+
+      const ravel_state &
+      state() const
+        {
+          return current;
+        }
+
+    private:
+      friend class Engine;
+
+      Session(const shared_ptr<const mask_set> &masks);
+
+      const shared_ptr<const mask_set> masks;
+      ravel_state current;
+      atomic<bool> cancelled;
+  };
 }
\ No newline at end of file
@@ -0,0 +1,63 @@
+/*
+  Raveler
+  Copyright (C) 2021 Jonathan Perry-Houts
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <iostream>
+#include <vector>
+#include <chrono>
+
+using namespace std;
+
+/*
+ * Wall clock time plus hardware cache and dTLB miss counts
+ * for one benchmark run. Counts are -1 where perf counters
+ * are unavailable (e.g. kernel.perf_event_paranoid > 2, or
+ * inside some containers).
+ */
+struct
+counters
+{
+  int cache_fd;
+  int tlb_fd;
+  chrono::steady_clock::time_point start;
+  double seconds;
+  long long cache_misses;
+  long long tlb_misses;
+};
+
+void
+start_counters(counters &c);
+
+void
+stop_counters(counters &c);
+
+void
+synthetic_image(const int res,
+                vector<double> &image);
+
+int
+bench_layouts(const int res,
+              const int k,
+              const int N);
+
+/*
+ * Time the generic and the compile-time specialized kernels
+ * on each configuration that has one, checking that both
+ * produce the same design.
+ */
+int
+bench_kernels(const int N);
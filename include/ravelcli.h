@@ -18,6 +18,7 @@
 
 #include <iostream>
 #include <vector>
+#include <string>
 
 #ifndef NOMAGICK
 #include <Magick++.h>
@@ -35,8 +36,184 @@ int
 load_image(const std::string &fname,
            std::vector<double> &pixels,
            const int res,
-           const bool white_thread);
+           const bool white_thread,
+           const bool color);
 #endif
 
+/*
+ * Whether input names a raw 8-bit grayscale file, whose
+ * resolution follows from its size.
+ */
+bool
+is_raw_file(const string &input);
+
+/*
+ * Read the source image, either from a file or as raw
+ * bytes from stdin. Color images are returned as
+ * interleaved RGB values.
+ */
+int
+read_input(const string &input,
+           vector<double> &image,
+           int &res,
+           const bool white_thread,
+           const bool color);
+
+/*
+ * Split an interleaved RGB image into one residual image
+ * per thread color of the given color model (cmyk|rgb).
+ */
+int
+split_channels(const vector<double> &rgb,
+               const string &colors,
+               vector<vector<double>> &channels,
+               vector<string> &names);
+
+int
+write_design(const string &output,
+             const string &format,
+             const vector<int> &path,
+             const vector<double> &scores,
+             const int k,
+             const double weight,
+             const double frame_size,
+             const bool white_thread,
+             const Raveler::score_encoding score_format = Raveler::SCORES_FLOAT16);
+
+/*
+ * Read a design written in any of the csv|tsv|json|bin
+ * formats. The binary format also carries k, weight, frame
+ * size and thread colour; text formats leave them as given.
+ */
+int
+read_design(const string &input,
+            vector<int> &path,
+            vector<double> &scores,
+            int &k,
+            double &weight,
+            double &frame_size,
+            bool &white_thread);
+
+int
+write_channel_design(const string &output,
+                     const string &format,
+                     const vector<Raveler::segment> &segments,
+                     const vector<string> &names,
+                     const int k,
+                     const double weight,
+                     const double frame_size,
+                     const bool white_thread);
+
+/*
+ * Print memory use and rasterization error of compressed
+ * masks (rotate|grid) for the given configuration.
+ */
+int
+print_mask_deviation(const int k,
+                     const int res,
+                     const int oversample,
+                     const string &compress);
+
+/*
+ * Line masks for a monochrome ravel, in whichever form it
+ * will use: flat masks or compressed masks.
+ */
+struct
+ravel_masks
+{
+  Raveler::flat_masks flat;
+  Raveler::compressed_masks compressed;
+  bool loaded;
+  double seconds;
+};
+
+/*
+ * Build the masks for one configuration. With a cache file
+ * name, uncompressed masks are loaded from it if it was made
+ * for the same configuration, and saved to it otherwise.
+ * Only depends on the configuration, so it may run while the
+ * image is still being decoded.
+ */
+int
+prepare_masks(const int k,
+              const int res,
+              const int oversample,
+              const Raveler::layout_type layout_type,
+              const string &compress,
+              const Raveler::mask_symmetry symmetry,
+              const string &cache,
+              ravel_masks &masks);
+
+/*
+ * Atomically replace fname with a serialized ravel state.
+ */
+int
+save_checkpoint(const string &fname,
+                const Raveler::ravel_state &state);
+
+/*
+ * Ravel a sequence of frames, from a directory or as raw
+ * gray8 frames on stdin, warm starting each frame from the
+ * previous one's path.
+ */
+int
+run_sequence(const string &source,
+             const string &output,
+             const string &format,
+             int res,
+             const int k,
+             const int N,
+             const int oversample,
+             const double weight,
+             const double frame_size,
+             const bool white_thread,
+             const double tolerance);
+
+/*
+ * Parse a sweep range, given either as "start:stop:step"
+ * (inclusive of stop) or as a comma separated list.
+ */
+vector<double>
+parse_range(const string &spec);
+
+struct
+sweep_result
+{
+  int k;
+  int N;
+  double weight;
+  double frame_size;
+  double error;
+  double length;
+  vector<int> path;
+  vector<double> scores;
+};
+
+/*
+ * Ravel every combination of k, weight and frame size on
+ * num_threads worker threads. The image is shared by all
+ * runs and one mask table is built per k, on the first
+ * worker that needs it. Each combination is raveled once to
+ * the largest N and snapshotted at every requested N, as a
+ * draft if draft.fraction > 0. Results are sorted by
+ * reconstruction error, best first.
+ */
+int
+run_sweep(const vector<double> &image,
+          const int res,
+          const int oversample,
+          const Raveler::layout_type layout,
+          const Raveler::draft_options &draft,
+          const vector<double> &ks,
+          const vector<double> &Ns,
+          const vector<double> &weights,
+          const vector<double> &frame_sizes,
+          const int num_threads,
+          vector<sweep_result> &results);
+
+void
+print_sweep_summary(const vector<sweep_result> &results,
+                    ostream &out);
+
 void
 print_help();
\ No newline at end of file
@@ -28,9 +28,11 @@
 
 using namespace std;
 
+// The masks are immutable once built by init(), so calls to
+// ravel() never interfere.
 struct
 {
-  vector<vector<int>> line_masks;
+  Raveler::flat_masks masks;
   unsigned char pixel_buffer[RES2];
 } global;
 
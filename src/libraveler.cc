@@ -17,6 +17,14 @@
 */
 
 #include "libraveler.h"
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace Raveler
 {
@@ -36,9 +44,11 @@ namespace Raveler
       double dy = cy1 - cy0;
       int R = (int) (oversample * sqrt(dx*dx + dy*dy));
 
+      // Each point is repeated oversample times, and the last
+      // one lands on loc1.
+      const double denominator = max((R-1)/oversample, 1);
       for (int i=0; i<R; ++i)
         {
-          double denominator = (R == oversample) ? 1.0 : (R/oversample-1.0);
           int p_i = cx0 + i/oversample*dx/denominator;
           int p_j = cy0 + i/oversample*dy/denominator;
           int loc = ij_to_loc(p_i, p_j, res);
@@ -68,21 +78,901 @@ namespace Raveler
           }
   }
 
+  // Interleave the bits of i and j into a Z-order index
+  inline
+  long long
+  morton_code(const int i,
+              const int j)
+    {
+      long long code = 0;
+      for (int bit=0; bit<16; ++bit)
+        {
+          code |= (long long) ((i >> bit) & 1) << (2*bit);
+          code |= (long long) ((j >> bit) & 1) << (2*bit + 1);
+        }
+      return code;
+    }
+
+  void
+  make_layout(const int res,
+              const layout_type type,
+              pixel_layout &layout)
+    {
+      layout.res = res;
+      layout.type = type;
+      layout.index.clear();
+
+      if (type == ROW_MAJOR)
+        {
+          layout.size = res*res;
+          return;
+        }
+
+      // Pins sit on a circle of radius (res-1)/2. Rounding the
+      // pins and then the points of each line down to whole
+      // pixels may each move off it by up to one pixel diagonal.
+      // Lines run from pin to pin and never past them, at any
+      // oversampling, so nothing outside that margin is touched.
+      const double center = (res-1) / 2.0;
+      const double radius = center + 2*M_SQRT2;
+      const int tile = 8;
+
+      vector<pair<long long,int>> order;
+      for (int j=0; j<res; ++j)
+        for (int i=0; i<res; ++i)
+          {
+            double di = i - center, dj = j - center;
+            if (di*di + dj*dj > radius*radius)
+              continue;
+
+            long long key;
+            if (type == MORTON)
+              key = morton_code(i, j);
+            else
+              key = ((long long) (j/tile) * ((res+tile-1)/tile) + i/tile)
+                    * tile*tile + (j%tile)*tile + i%tile;
+            order.push_back(make_pair(key, ij_to_loc(i, j, res)));
+          }
+      sort(order.begin(), order.end());
+
+      layout.size = order.size();
+      layout.index.assign(res*res, -1);
+      for (unsigned int n=0; n<order.size(); ++n)
+        layout.index[order[n].second] = n;
+    }
+
+  void
+  to_layout(const vector<double> &image,
+            const pixel_layout &layout,
+            vector<double> &stored)
+    {
+      if (layout.type == ROW_MAJOR)
+        {
+          stored = image;
+          return;
+        }
+
+      stored.resize(layout.size);
+      for (unsigned int loc=0; loc<layout.index.size(); ++loc)
+        if (layout.index[loc] != -1)
+          stored[layout.index[loc]] = image[loc];
+    }
+
+  void
+  fill_line_masks(const int k,
+                  const int res,
+                  const int oversample,
+                  const pixel_layout &layout,
+                  vector<vector<int>> &lines)
+    {
+      fill_line_masks(k, res, oversample, lines);
+      if (layout.type == ROW_MAJOR)
+        return;
+
+      for (unsigned int idx=0; idx<lines.size(); ++idx)
+        {
+          vector<int> &line = lines[idx];
+          int pos=0;
+          for (; line[pos] != -1; pos++)
+            {
+              line[pos] = layout.index[line[pos]];
+              assert(line[pos] != -1);
+            }
+          sort(line.begin(), line.begin() + pos);
+        }
+    }
+
   double
   get_score(const int a,
             const int b,
             const int k,
             const double weight,
-            const vector<double> &residual,
-            const vector<vector<int>> &lines)
+            const vector<double> &residual,
+            const vector<vector<int>> &lines)
+    {
+      const int idx = a*k + b;
+      double integrated_residual = 0.0;
+      int pos=0;
+      for (; lines[idx][pos] != -1; pos++)
+        integrated_residual += residual[lines[idx][pos]];
+      double score = weight * (2 * integrated_residual - weight * pos);
+      return score;
+    }
+
+  int
+  fill_compressed_masks(const int k,
+                        const int res,
+                        const int oversample,
+                        const mask_symmetry symmetry,
+                        compressed_masks &masks)
+    {
+      if (symmetry == GRID && k%4 != 0)
+        return 1;
+
+      masks.k = k;
+      masks.res = res;
+      masks.oversample = oversample;
+      masks.symmetry = symmetry;
+      masks.max_length = (int) oversample * sqrt(2*res*res);
+      masks.offsets.clear();
+      masks.points.clear();
+      masks.locs.clear();
+      masks.cos_pin.clear();
+      masks.sin_pin.clear();
+
+      vector<int> pin_locs(k);
+      for (int pos=0; pos<k; ++pos)
+        pin_locs[pos] = pin_to_loc(pos, k, res);
+
+      vector<int> buffer(masks.max_length+1);
+
+      if (symmetry == ROTATE)
+        {
+          // One template for each offset from pin 0, stored
+          // as pixel centres relative to the middle of the
+          // circle, ready to be rotated.
+          const double center = (res-1) / 2.0;
+          masks.fold = k;
+          for (int d=0; d<=k/2; ++d)
+            {
+              masks.offsets.push_back(masks.points.size()/2);
+              int R = get_line(pin_locs[0], pin_locs[d], res, oversample,
+                               buffer, buffer);
+              for (int n=0; n<R; ++n)
+                {
+                  masks.points.push_back(buffer[n]%res + 0.5 - center);
+                  masks.points.push_back(buffer[n]/res + 0.5 - center);
+                }
+            }
+          masks.offsets.push_back(masks.points.size()/2);
+
+          for (int pin=0; pin<k; ++pin)
+            {
+              double phi = 2.0 * M_PI * pin / k;
+              masks.cos_pin.push_back(cos(phi));
+              masks.sin_pin.push_back(sin(phi));
+            }
+        }
+      else
+        {
+          // Lines starting in the first quarter (or eighth) of
+          // the circle, stored exactly as fill_line_masks would.
+          masks.fold = (k%8 == 0) ? 8 : 4;
+          const int rows = (masks.fold == 8) ? k/8+1 : k/4;
+          for (int a=0; a<rows; ++a)
+            for (int b=0; b<k; ++b)
+              {
+                masks.offsets.push_back(masks.locs.size());
+                int R = get_line(pin_locs[a], pin_locs[b], res, oversample,
+                                 buffer, buffer);
+                masks.locs.insert(masks.locs.end(), buffer.begin(),
+                                  buffer.begin() + R);
+              }
+          masks.offsets.push_back(masks.locs.size());
+        }
+
+      return 0;
+    }
+
+  int
+  expand_line(const compressed_masks &masks,
+              const int a,
+              const int b,
+              int *buffer)
+    {
+      const int k = masks.k, res = masks.res;
+      int length = 0;
+
+      if (masks.symmetry == ROTATE)
+        {
+          // Lines are symmetric, so rotate whichever end makes
+          // the offset to the other end at most k/2.
+          int d = ((b-a)%k + k)%k;
+          int pin = a;
+          if (d > k/2)
+            {
+              d = k-d;
+              pin = b;
+            }
+
+          const double center = (res-1) / 2.0;
+          const double c = masks.cos_pin[pin], s = masks.sin_pin[pin];
+          for (int n=masks.offsets[d]; n<masks.offsets[d+1]; ++n)
+            {
+              const double u = masks.points[2*n], v = masks.points[2*n+1];
+              int i = (int) floor(center + u*c + v*s);
+              int j = (int) floor(center + v*c - u*s);
+              i = min(max(i, 0), res-1);
+              j = min(max(j, 0), res-1);
+              buffer[length++] = ij_to_loc(i, j, res);
+            }
+        }
+      else
+        {
+          // A quarter turn takes pin p to p+k/4 and pixel (i,j)
+          // to (j, res-2-i). Mirroring across the diagonal takes
+          // pin p to k/4-p and pixel (i,j) to (j,i).
+          const int quarter = k/4;
+          const int turns = a / quarter;
+          int a0 = a % quarter;
+          int b0 = ((b - turns*quarter)%k + k)%k;
+          bool mirror = false;
+          if (masks.fold == 8 && a0 > k/8)
+            {
+              a0 = quarter - a0;
+              b0 = ((quarter - b0)%k + k)%k;
+              mirror = true;
+            }
+
+          const int row = a0*k + b0;
+          for (int n=masks.offsets[row]; n<masks.offsets[row+1]; ++n)
+            {
+              int i = masks.locs[n]%res, j = masks.locs[n]/res;
+              if (mirror)
+                swap(i, j);
+              for (int t=0; t<turns; ++t)
+                {
+                  int tmp = i;
+                  i = j;
+                  j = res-2-tmp;
+                }
+              i = min(max(i, 0), res-1);
+              j = min(max(j, 0), res-1);
+              buffer[length++] = ij_to_loc(i, j, res);
+            }
+        }
+
+      buffer[length] = -1;
+      return length;
+    }
+
+  size_t
+  mask_bytes(const vector<vector<int>> &lines)
+    {
+      size_t bytes = lines.capacity() * sizeof(vector<int>);
+      for (unsigned int idx=0; idx<lines.size(); ++idx)
+        bytes += lines[idx].capacity() * sizeof(int);
+      return bytes;
+    }
+
+  size_t
+  mask_bytes(const compressed_masks &masks)
+    {
+      return masks.offsets.capacity() * sizeof(int)
+           + masks.points.capacity() * sizeof(float)
+           + masks.locs.capacity() * sizeof(int)
+           + (masks.cos_pin.capacity() + masks.sin_pin.capacity()) * sizeof(double);
+    }
+
+  void
+  compare_masks(const compressed_masks &masks,
+                mask_deviation &deviation)
+    {
+      const int k = masks.k, res = masks.res;
+      vector<int> pin_locs(k);
+      for (int pos=0; pos<k; ++pos)
+        pin_locs[pos] = pin_to_loc(pos, k, res);
+
+      vector<int> direct(masks.max_length+1), expanded(masks.max_length+1);
+      vector<int> common(masks.max_length+1);
+
+      // Pixels within one step of the current direct line are
+      // stamped with its number, so the grid never needs clearing.
+      vector<int> near_line(res*res, -1);
+
+      int lines = 0, identical = 0;
+      long long total_pixels = 0, adjacent_pixels = 0;
+      double overlap = 0.0, length_error = 0.0;
+      for (int a=0; a<k; ++a)
+        for (int b=a+1; b<k; ++b)
+          {
+            int R0 = get_line(pin_locs[a], pin_locs[b], res, masks.oversample,
+                              direct, direct);
+            int R1 = expand_line(masks, a, b, &expanded[0]);
+
+            for (int n=0; n<R0; ++n)
+              {
+                const int i = direct[n]%res, j = direct[n]/res;
+                for (int dj=-1; dj<=1; ++dj)
+                  for (int di=-1; di<=1; ++di)
+                    if (i+di >= 0 && i+di < res && j+dj >= 0 && j+dj < res)
+                      near_line[ij_to_loc(i+di, j+dj, res)] = lines;
+              }
+            for (int n=0; n<R1; ++n)
+              adjacent_pixels += (near_line[expanded[n]] == lines);
+            total_pixels += R1;
+
+            sort(direct.begin(), direct.begin() + R0);
+            sort(expanded.begin(), expanded.begin() + R1);
+            int n0 = unique(direct.begin(), direct.begin() + R0) - direct.begin();
+            int n1 = unique(expanded.begin(), expanded.begin() + R1) - expanded.begin();
+            int shared = set_intersection(direct.begin(), direct.begin() + n0,
+                                          expanded.begin(), expanded.begin() + n1,
+                                          common.begin()) - common.begin();
+
+            lines++;
+            identical += (shared == n0 && shared == n1);
+            overlap += (n0 + n1 - shared > 0)
+                     ? (double) shared / (n0 + n1 - shared) : 1.0;
+            length_error += abs(R0 - R1);
+          }
+
+      deviation.identical = (double) identical / lines;
+      deviation.overlap = overlap / lines;
+      deviation.adjacent = (total_pixels > 0)
+                         ? (double) adjacent_pixels / total_pixels : 1.0;
+      deviation.length_error = length_error / lines;
+    }
+
+  /*
+  * Sources of line masks for ravel_steps. Calling one with a
+  * pair of pins returns that line's pixel indices, terminated
+  * by -1.
+  */
+  struct
+  table_lines
+  {
+    const vector<vector<int>> &lines;
+    const int k;
+
+    const int*
+    operator()(const int a, const int b)
+      {
+        return &lines[a*k + b][0];
+      }
+  };
+
+  struct
+  expanded_lines
+  {
+    const compressed_masks &masks;
+    vector<int> buffer;
+
+    expanded_lines(const compressed_masks &masks)
+      : masks(masks), buffer(masks.max_length + 1)
+      {}
+
+    const int*
+    operator()(const int a, const int b)
+      {
+        expand_line(masks, a, b, &buffer[0]);
+        return &buffer[0];
+      }
+  };
+
+  struct
+  flat_lines
+  {
+    const flat_masks &masks;
+
+    const int*
+    operator()(const int a, const int b)
+      {
+        return &masks.locs[masks.offsets[a*masks.k + b]];
+      }
+  };
+
+  // Same as get_score, for any kind of mask storage
+  inline
+  double
+  line_score(const int *pixels,
+             const vector<double> &residual,
+             const double visual_weight)
+    {
+      double integrated_residual = 0.0;
+      int pos=0;
+      for (; pixels[pos] != -1; pos++)
+        integrated_residual += residual[pixels[pos]];
+      return visual_weight * (2 * integrated_residual - visual_weight * pos);
+    }
+
+  // Whether pin is the end of the first path_size pins of the
+  // path or the one before it, which the next line may not go
+  // to.
+  inline
+  bool
+  recently_visited(const vector<int> &path,
+                   const int path_size,
+                   const int pin)
+    {
+      bool visited = false;
+      for (int n=1; (n < 3) && (n < path_size); ++n)
+        visited |= (path[path_size-n] == pin);
+      return visited;
+    }
+
+  /*
+  * Sources of candidate pins for ravel_steps. start() is
+  * called once per step, then the candidates are read with
+  * size() and [], and each one that gets scored is reported
+  * back through scored().
+  */
+  struct
+  all_pins
+  {
+    const int k;
+
+    void
+    start(const int path_size)
+      {}
+
+    int
+    size() const
+      {
+        return k;
+      }
+
+    int
+    operator[](const int c) const
+      {
+        return c;
+      }
+
+    void
+    scored(const int pin,
+           const double score)
+      {}
+  };
+
+  /*
+  * A random subset of the pins at each step (plus the best
+  * few of the previous step), until exhaustive_from, after
+  * which every pin is a candidate again. Kept across calls so
+  * that checkpointed runs draw the same sequence as
+  * uninterrupted ones.
+  */
+  struct
+  draft_pins
+  {
+    const draft_options &options;
+    const int k;
+    const int samples;
+    const int exhaustive_from;
+    mt19937 rng;
+    vector<int> pins;
+    vector<int> seen;
+    vector<int> candidates;
+    vector<int> top;
+    vector<double> top_scores;
+
+    draft_pins(const draft_options &options,
+               const int k,
+               const int exhaustive_from)
+      : options(options), k(k),
+        samples(max(1, (int) round(options.fraction * k))),
+        exhaustive_from(exhaustive_from), rng(options.seed), pins(k),
+        seen(k, -1), top(max(options.keep_top, 0), -1),
+        top_scores(max(options.keep_top, 0))
+      {
+        for (int pin=0; pin<k; ++pin)
+          pins[pin] = pin;
+        candidates.reserve(k + top.size());
+      }
+
+    void
+    start(const int path_size)
+      {
+        const int keep = top.size();
+        candidates.clear();
+        if (path_size >= exhaustive_from || samples >= k)
+          candidates = pins;
+        else
+          {
+            for (int t=0; t<keep; ++t)
+              if (top[t] >= 0 && seen[top[t]] != path_size)
+                {
+                  seen[top[t]] = path_size;
+                  candidates.push_back(top[t]);
+                }
+
+            for (int n=0; n<samples; ++n)
+              {
+                int pin;
+                if (options.stratified)
+                  {
+                    // One pin from each of 'samples' equal arcs
+                    const int lo = n*k/samples, hi = (n+1)*k/samples;
+                    pin = lo + rng() % (hi-lo);
+                  }
+                else
+                  {
+                    // Partial Fisher-Yates shuffle
+                    const int j = n + rng() % (k-n);
+                    swap(pins[n], pins[j]);
+                    pin = pins[n];
+                  }
+
+                if (seen[pin] != path_size)
+                  {
+                    seen[pin] = path_size;
+                    candidates.push_back(pin);
+                  }
+              }
+          }
+
+        for (int t=0; t<keep; ++t)
+          {
+            top[t] = -1;
+            top_scores[t] = -1e20;
+          }
+      }
+
+    int
+    size() const
+      {
+        return candidates.size();
+      }
+
+    int
+    operator[](const int c) const
+      {
+        return candidates[c];
+      }
+
+    void
+    scored(const int pin,
+           const double score)
+      {
+        // Insertion into the (short) list of best pins
+        const int keep = top.size();
+        for (int t=0; t<keep; ++t)
+          if (score > top_scores[t])
+            {
+              for (int u=keep-1; u>t; --u)
+                {
+                  top[u] = top[u-1];
+                  top_scores[u] = top_scores[u-1];
+                }
+              top[t] = pin;
+              top_scores[t] = score;
+              return;
+            }
+      }
+  };
+
+  /*
+  * Greedily extend path from path[from-1] until it holds
+  * path[to], updating the residual as each line is laid.
+  * Only the pins offered by 'candidates' are scored at each
+  * step. path and scores must already be large enough.
+  *
+  * Returns:
+  *   Number of lines in the path when stopped; less than
+  *   'to' only if cancelled.
+  */
+  template <class line_source, class pin_source>
+  int
+  ravel_steps(const int from,
+              const int to,
+              const double visual_weight,
+              const int k,
+              line_source &line,
+              pin_source &candidates,
+              vector<double> &residual,
+              vector<int> &path,
+              vector<double> &scores,
+              const atomic<bool> *cancelled = nullptr)
+    {
+      for (int path_size=from; path_size <= to; path_size++)
+        {
+          if (cancelled && cancelled->load(memory_order_relaxed))
+            return path_size-1;
+
+          int previous_pin = path[path_size-1];
+          int next_pin = (previous_pin+1)%k;
+          double score = -1e20;
+
+          candidates.start(path_size);
+          const int count = candidates.size();
+          for (int c=0; c<count; ++c)
+            {
+              const int pin = candidates[c];
+              if (recently_visited(path, path_size, pin))
+                continue;
+
+              double pin_score = line_score(line(previous_pin, pin), residual,
+                                            visual_weight);
+
+              if (pin_score > score)
+                {
+                  score = pin_score;
+                  next_pin = pin;
+                }
+              candidates.scored(pin, pin_score);
+            }
+
+          path[path_size] = next_pin;
+          scores[path_size-1] = score;
+
+          const int *pixels = line(previous_pin, next_pin);
+          for (int i=0; pixels[i] != -1; ++i)
+            residual[pixels[i]] -= visual_weight;
+        }
+      return to;
+    }
+
+  void
+  do_ravel( const vector<double> &image,
+            const double weight,
+            const int k,
+            const int N,
+            const vector<vector<int>> &lines,
+            vector<int> &path,
+            vector<double> &scores)
+    {
+      const double visual_weight = get_visual_weight(weight);
+
+      vector<double> residual(image);
+      table_lines line = { lines, k };
+
+      all_pins pins = { k };
+
+      path[0] = 0;
+      ravel_steps(1, N, visual_weight, k, line, pins, residual, path, scores);
+    }
+
+  void
+  do_ravel( const vector<double> &image,
+            const double weight,
+            const int k,
+            const int N,
+            const compressed_masks &masks,
+            vector<int> &path,
+            vector<double> &scores)
+    {
+      const double visual_weight = get_visual_weight(weight);
+
+      vector<double> residual(image);
+      expanded_lines line(masks);
+
+      all_pins pins = { k };
+
+      path[0] = 0;
+      ravel_steps(1, N, visual_weight, k, line, pins, residual, path, scores);
+    }
+
+  void
+  init_state(const vector<double> &image,
+             const double weight,
+             const int k,
+             const int res,
+             const int oversample,
+             ravel_state &state,
+             const layout_type layout)
+    {
+      state.k = k;
+      state.res = res;
+      state.oversample = oversample;
+      state.layout = layout;
+      state.weight = weight;
+      state.thread_weight = 0;
+      state.frame_size = 0;
+      state.white_thread = false;
+      state.residual = image;
+      state.path.assign(1, 0);
+      state.scores.clear();
+    }
+
+  template <class line_source>
+  bool
+  resume_with(ravel_state &state,
+              const int N,
+              line_source &line,
+              const int checkpoint_every,
+              const function<void(const ravel_state&)> &checkpoint,
+              const atomic<bool> *cancelled = nullptr,
+              const draft_options *draft = nullptr)
+    {
+      const double visual_weight = get_visual_weight(state.weight);
+      int done = state.path.size() - 1;
+      if (N <= done)
+        return true;
+
+      all_pins every = { state.k };
+      unique_ptr<draft_pins> sampled;
+      if (draft)
+        sampled.reset(new draft_pins(*draft, state.k,
+                                     N+1 - draft->exhaustive_tail));
+
+      // Run straight into the full-size buffers, and only trim
+      // them to the current length when handing out a snapshot.
+      state.path.resize(N+1);
+      state.scores.resize(N);
+
+      while (done < N)
+        {
+          int stop = N;
+          if (checkpoint_every > 0 && done + checkpoint_every < N)
+            stop = done + checkpoint_every;
+
+          if (sampled)
+            done = ravel_steps(done+1, stop, visual_weight, state.k, line,
+                               *sampled, state.residual, state.path,
+                               state.scores, cancelled);
+          else
+            done = ravel_steps(done+1, stop, visual_weight, state.k, line,
+                               every, state.residual, state.path,
+                               state.scores, cancelled);
+          if (done < stop)
+            {
+              state.path.resize(done+1);
+              state.scores.resize(done);
+              return false;
+            }
+
+          if (checkpoint && done < N)
+            {
+              ravel_state snapshot(state);
+              snapshot.path.resize(done+1);
+              snapshot.scores.resize(done);
+              checkpoint(snapshot);
+            }
+        }
+      return true;
+    }
+
+  void
+  resume_ravel(ravel_state &state,
+               const int N,
+               const vector<vector<int>> &lines,
+               const int checkpoint_every,
+               const function<void(const ravel_state&)> &checkpoint)
+    {
+      table_lines line = { lines, state.k };
+      resume_with(state, N, line, checkpoint_every, checkpoint);
+    }
+
+  void
+  resume_ravel(ravel_state &state,
+               const int N,
+               const compressed_masks &masks,
+               const int checkpoint_every,
+               const function<void(const ravel_state&)> &checkpoint)
+    {
+      expanded_lines line(masks);
+      resume_with(state, N, line, checkpoint_every, checkpoint);
+    }
+
+  void
+  resume_ravel(ravel_state &state,
+               const int N,
+               const vector<vector<int>> &lines,
+               const draft_options &draft,
+               const int checkpoint_every,
+               const function<void(const ravel_state&)> &checkpoint)
+    {
+      table_lines line = { lines, state.k };
+      resume_with(state, N, line, checkpoint_every, checkpoint,
+                  nullptr, &draft);
+    }
+
+  static void
+  fill_flat_masks(const int k,
+                  const int res,
+                  const int oversample,
+                  const pixel_layout *layout,
+                  flat_masks &masks)
+    {
+      vector<int> pin_locs(k);
+      for (int pos=0; pos<k; ++pos)
+        pin_locs[pos] = pin_to_loc(pos, k, res);
+
+      masks.k = k;
+      masks.res = res;
+      masks.oversample = oversample;
+      masks.layout = layout ? layout->type : ROW_MAJOR;
+      masks.offsets.resize(k*k + 1);
+      masks.locs.clear();
+
+      vector<int> buffer((int) oversample * sqrt(2*res*res));
+      for (int a=0; a<k; ++a)
+        for (int b=0; b<k; ++b)
+          {
+            // Always drawn from the lower pin, and mapped and
+            // sorted as in fill_line_masks
+            const int length = get_line(pin_locs[min(a, b)], pin_locs[max(a, b)],
+                                        res, oversample, buffer, buffer);
+            if (layout && layout->type != ROW_MAJOR)
+              {
+                for (int pos=0; pos<length; ++pos)
+                  buffer[pos] = layout->index[buffer[pos]];
+                sort(buffer.begin(), buffer.begin() + length);
+              }
+            masks.offsets[a*k + b] = masks.locs.size();
+            masks.locs.insert(masks.locs.end(), buffer.begin(),
+                              buffer.begin() + length);
+            masks.locs.push_back(-1);
+          }
+      masks.offsets[k*k] = masks.locs.size();
+    }
+
+  void
+  fill_flat_masks(const int k,
+                  const int res,
+                  const int oversample,
+                  flat_masks &masks)
+    {
+      fill_flat_masks(k, res, oversample, nullptr, masks);
+    }
+
+  void
+  fill_flat_masks(const int k,
+                  const int res,
+                  const int oversample,
+                  const pixel_layout &layout,
+                  flat_masks &masks)
+    {
+      fill_flat_masks(k, res, oversample, &layout, masks);
+    }
+
+  size_t
+  mask_bytes(const flat_masks &masks)
+    {
+      return (masks.offsets.capacity() + masks.locs.capacity()) * sizeof(int);
+    }
+
+  void
+  do_ravel( const vector<double> &image,
+            const double weight,
+            const int k,
+            const int N,
+            const flat_masks &masks,
+            vector<int> &path,
+            vector<double> &scores)
     {
-      const int idx = a*k + b;
-      double integrated_residual = 0.0;
-      int pos=0;
-      for (; lines[idx][pos] != -1; pos++)
-        integrated_residual += residual[lines[idx][pos]];
-      double score = weight * (2 * integrated_residual - weight * pos);
-      return score;
+      const double visual_weight = get_visual_weight(weight);
+
+      vector<double> residual(image);
+      flat_lines line = { masks };
+
+      all_pins pins = { k };
+
+      path[0] = 0;
+      ravel_steps(1, N, visual_weight, k, line, pins, residual, path, scores);
+    }
+
+  void
+  resume_ravel(ravel_state &state,
+               const int N,
+               const flat_masks &masks,
+               const int checkpoint_every,
+               const function<void(const ravel_state&)> &checkpoint)
+    {
+      flat_lines line = { masks };
+      resume_with(state, N, line, checkpoint_every, checkpoint);
+    }
+
+  void
+  resume_ravel(ravel_state &state,
+               const int N,
+               const flat_masks &masks,
+               const draft_options &draft,
+               const int checkpoint_every,
+               const function<void(const ravel_state&)> &checkpoint)
+    {
+      flat_lines line = { masks };
+      resume_with(state, N, line, checkpoint_every, checkpoint,
+                  nullptr, &draft);
     }
 
   void
@@ -91,52 +981,771 @@ namespace Raveler
             const int k,
             const int N,
             const vector<vector<int>> &lines,
+            const draft_options &draft,
             vector<int> &path,
             vector<double> &scores)
     {
-      // For whatever reason, the visual effect of a strand of
-      // thread crossing any particular region seems to be lower
-      // than what you'd predict. This 0.7 scale factor seems
-      // to produce output that looks roughly true to reality.
-      const double visual_weight = 0.7 * weight;
+      ravel_state state;
+      init_state(image, weight, k, 0, 0, state);
+      resume_ravel(state, N, lines, draft);
+      path = state.path;
+      scores = state.scores;
+    }
 
-      vector<double> residual(image);
+  template <class line_source>
+  int
+  replay_with(ravel_state &state,
+              const ravel_state &previous,
+              line_source &line,
+              const double tolerance)
+    {
+      const double visual_weight = get_visual_weight(state.weight);
+      const vector<int> &path = previous.path;
+
+      int kept = state.path.size() - 1;
+      while (kept+1 < (int) path.size()
+             && kept < (int) previous.scores.size()
+             && state.path.back() == path[kept])
+        {
+          const int *pixels = line(path[kept], path[kept+1]);
+          const double score = line_score(pixels, state.residual, visual_weight);
+          if (score <= 0 || score < tolerance * previous.scores[kept])
+            break;
+
+          state.path.push_back(path[kept+1]);
+          state.scores.push_back(score);
+
+          for (int i=0; pixels[i] != -1; ++i)
+            state.residual[pixels[i]] -= visual_weight;
+          kept++;
+        }
+      return kept;
+    }
+
+  int
+  replay_prefix(ravel_state &state,
+                const ravel_state &previous,
+                const vector<vector<int>> &lines,
+                const double tolerance)
+    {
+      table_lines line = { lines, state.k };
+      return replay_with(state, previous, line, tolerance);
+    }
+
+  int
+  replay_prefix(ravel_state &state,
+                const ravel_state &previous,
+                const flat_masks &masks,
+                const double tolerance)
+    {
+      flat_lines line = { masks };
+      return replay_with(state, previous, line, tolerance);
+    }
+
+  // Magic number and version at the head of a saved ravel state.
+  static const char state_magic[4] = {'R', 'A', 'V', 'S'};
+  static const int32_t state_version = 3;
+
+  int
+  write_state(ostream &out,
+              const ravel_state &state)
+    {
+      const int32_t header[6] = { state_version, state.k, state.res,
+                                  state.oversample, state.layout,
+                                  state.white_thread ? 1 : 0 };
+      const double design[2] = { state.thread_weight, state.frame_size };
+      const int64_t sizes[3] = { (int64_t) state.residual.size(),
+                                 (int64_t) state.path.size(),
+                                 (int64_t) state.scores.size() };
+
+      out.write(state_magic, sizeof(state_magic));
+      out.write((const char*) header, sizeof(header));
+      out.write((const char*) &state.weight, sizeof(state.weight));
+      out.write((const char*) design, sizeof(design));
+      out.write((const char*) sizes, sizeof(sizes));
+
+      vector<int32_t> path(state.path.begin(), state.path.end());
+      out.write((const char*) state.residual.data(), sizes[0]*sizeof(double));
+      out.write((const char*) path.data(), sizes[1]*sizeof(int32_t));
+      out.write((const char*) state.scores.data(), sizes[2]*sizeof(double));
+
+      return out.good() ? 0 : 1;
+    }
+
+  int
+  read_state(istream &in,
+             ravel_state &state)
+    {
+      char magic[4];
+      int32_t header[6] = { 0, 0, 0, 0, ROW_MAJOR, 0 };
+      double design[2] = { 0, 0 };
+      int64_t sizes[3];
+      double weight;
+
+      // Version 1 had no layout, and was always row-major.
+      // Neither it nor version 2 kept the thread weight, frame
+      // size and color of the design.
+      in.read(magic, sizeof(magic));
+      in.read((char*) header, sizeof(int32_t));
+      if (header[0] == 1)
+        in.read((char*) &header[1], 3*sizeof(int32_t));
+      else if (header[0] == 2)
+        in.read((char*) &header[1], 4*sizeof(int32_t));
+      else
+        in.read((char*) &header[1], 5*sizeof(int32_t));
+      in.read((char*) &weight, sizeof(weight));
+      if (header[0] >= 3)
+        in.read((char*) design, sizeof(design));
+      in.read((char*) sizes, sizeof(sizes));
+      if (!in.good() || !equal(magic, magic+4, state_magic))
+        return 1;
+      if (header[0] < 1 || header[0] > state_version)
+        return 2;
+
+      const int k = header[1];
+      const int res = header[2];
+      const int oversample = header[3];
+      const int layout = header[4];
+      if (k < 1 || k > 1<<15 || res < 1 || res > 1<<15
+          || oversample < 1 || oversample > 64
+          || (layout != ROW_MAJOR && layout != TILED && layout != MORTON)
+          || !isfinite(design[0]) || design[0] < 0
+          || !isfinite(design[1]) || design[1] < 0
+          || (header[5] != 0 && header[5] != 1))
+        return 1;
+
+      // The residual holds one value per stored pixel, all of
+      // them for row-major and those inside the circle
+      // otherwise. Both array sizes are checked against what is
+      // left of the stream, where that is known, before
+      // anything is allocated.
+      const int64_t pixels = (int64_t) res * res;
+      if (sizes[0] < 1 || sizes[0] > pixels
+          || (layout == ROW_MAJOR && sizes[0] != pixels)
+          || sizes[1] < 1 || sizes[1] > (int64_t) 1<<30
+          || sizes[2] != sizes[1]-1)
+        return 1;
+      const int64_t payload = sizes[0]*sizeof(double)
+                              + sizes[1]*sizeof(int32_t)
+                              + sizes[2]*sizeof(double);
+      const streampos here = in.tellg();
+      if (here != streampos(-1))
+        {
+          in.seekg(0, ios::end);
+          const streampos end = in.tellg();
+          in.seekg(here);
+          if (!in.good() || end - here < payload)
+            return 1;
+        }
+
+      vector<double> residual(sizes[0]);
+      vector<int32_t> path(sizes[1]);
+      vector<double> scores(sizes[2]);
+      in.read((char*) residual.data(), sizes[0]*sizeof(double));
+      in.read((char*) path.data(), sizes[1]*sizeof(int32_t));
+      in.read((char*) scores.data(), sizes[2]*sizeof(double));
+      if (!in.good())
+        return 1;
+      for (int64_t i=0; i<sizes[1]; ++i)
+        if (path[i] < 0 || path[i] >= k)
+          return 1;
+
+      state.k = k;
+      state.res = res;
+      state.oversample = oversample;
+      state.layout = (layout_type) layout;
+      state.weight = weight;
+      state.thread_weight = design[0];
+      state.frame_size = design[1];
+      state.white_thread = header[5] == 1;
+      state.residual.swap(residual);
+      state.path.assign(path.begin(), path.end());
+      state.scores.swap(scores);
+
+      return 0;
+    }
+
+  // Magic number and version at the head of a mask cache.
+  // Version 1 caches may hold oversampled lines that overshoot
+  // their end pin.
+  static const char mask_magic[4] = {'R', 'A', 'V', 'M'};
+  static const int32_t mask_version = 2;
+
+  static int
+  write_flat_masks(ostream &out,
+                   const int k,
+                   const int res,
+                   const int oversample,
+                   const layout_type layout,
+                   const vector<int> &offsets,
+                   const vector<int> &locs)
+    {
+      const int32_t header[5] = { mask_version, k, res, oversample, layout };
+      const int64_t size = locs.size();
+      vector<int32_t> buffer(offsets.begin(), offsets.end());
+
+      out.write(mask_magic, 4);
+      out.write((const char*) header, sizeof(header));
+      out.write((const char*) &size, sizeof(size));
+      out.write((const char*) buffer.data(), buffer.size()*sizeof(int32_t));
+      buffer.assign(locs.begin(), locs.end());
+      out.write((const char*) buffer.data(), buffer.size()*sizeof(int32_t));
+
+      return out.good() ? 0 : 1;
+    }
+
+  static int
+  read_flat_masks(istream &in,
+                  const int k,
+                  const int res,
+                  const int oversample,
+                  const layout_type layout,
+                  vector<int> &offsets,
+                  vector<int> &locs)
+    {
+      char magic[4];
+      int32_t header[5];
+      int64_t size;
+      in.read(magic, 4);
+      in.read((char*) header, sizeof(header));
+      in.read((char*) &size, sizeof(size));
+      if (!in.good() || memcmp(magic, mask_magic, 4) != 0
+          || header[0] != mask_version || header[1] != k || header[2] != res
+          || header[3] != oversample || header[4] != layout
+          || size < k*k || size > (int64_t) k*k * (oversample*2*res + 1))
+        return 1;
+
+      static_assert(sizeof(int) == sizeof(int32_t), "masks are stored as int32");
+      vector<int> stored_offsets(k*k + 1), stored_locs(size);
+      in.read((char*) stored_offsets.data(), stored_offsets.size()*sizeof(int32_t));
+      in.read((char*) stored_locs.data(), stored_locs.size()*sizeof(int32_t));
+      if (!in.good() || stored_offsets[0] != 0 || stored_offsets[k*k] != size)
+        return 1;
+
+      // Every line must be in bounds and end with its terminator
+      const int *loc = stored_locs.data();
+      for (int idx=0; idx<k*k; ++idx)
+        {
+          const int begin = stored_offsets[idx], end = stored_offsets[idx+1];
+          if (end <= begin || loc[end-1] != -1)
+            return 1;
+          for (int pos=begin; pos<end-1; ++pos)
+            if ((unsigned int) loc[pos] >= (unsigned int) (res*res))
+              return 1;
+        }
+
+      offsets.swap(stored_offsets);
+      locs.swap(stored_locs);
+      return 0;
+    }
+
+  int
+  write_mask_cache(ostream &out,
+                   const flat_masks &masks)
+    {
+      return write_flat_masks(out, masks.k, masks.res, masks.oversample,
+                              masks.layout, masks.offsets, masks.locs);
+    }
+
+  int
+  read_mask_cache(istream &in,
+                  const int k,
+                  const int res,
+                  const int oversample,
+                  const layout_type layout,
+                  flat_masks &masks)
+    {
+      vector<int> offsets, locs;
+      if (read_flat_masks(in, k, res, oversample, layout, offsets, locs) != 0)
+        return 1;
+
+      masks.k = k;
+      masks.res = res;
+      masks.oversample = oversample;
+      masks.layout = layout;
+      masks.offsets.swap(offsets);
+      masks.locs.swap(locs);
+      return 0;
+    }
+
+  // Magic number, version and header size of a binary design.
+  static const char design_magic[4] = {'R', 'A', 'V', 'D'};
+  static const int design_version = 1;
+  static const size_t design_header_bytes = 40;
+
+  static void
+  put_u16(vector<unsigned char> &out,
+          const uint32_t value)
+    {
+      out.push_back(value & 0xff);
+      out.push_back((value >> 8) & 0xff);
+    }
+
+  static void
+  put_u32(vector<unsigned char> &out,
+          const uint32_t value)
+    {
+      put_u16(out, value & 0xffff);
+      put_u16(out, value >> 16);
+    }
+
+  static void
+  put_f32(vector<unsigned char> &out,
+          const float value)
+    {
+      uint32_t bits;
+      memcpy(&bits, &value, sizeof(bits));
+      put_u32(out, bits);
+    }
+
+  static uint32_t
+  get_u16(const unsigned char *p)
+    {
+      return p[0] | (p[1] << 8);
+    }
+
+  static uint32_t
+  get_u32(const unsigned char *p)
+    {
+      return get_u16(p) | (get_u16(p+2) << 16);
+    }
+
+  static float
+  get_f32(const unsigned char *p)
+    {
+      const uint32_t bits = get_u32(p);
+      float value;
+      memcpy(&value, &bits, sizeof(value));
+      return value;
+    }
+
+  // IEEE 754 half precision, rounding to nearest even.
+  static uint16_t
+  float_to_half(const float value)
+    {
+      uint32_t x;
+      memcpy(&x, &value, sizeof(x));
+      const uint32_t sign = (x >> 16) & 0x8000;
+      const int exponent = (int) ((x >> 23) & 0xff) - 127 + 15;
+      uint32_t mantissa = x & 0x7fffff;
+
+      if (((x >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+      if (exponent >= 31)
+        return sign | 0x7c00;
+
+      int shift = 13;
+      uint32_t half = (exponent << 10) | (mantissa >> 13);
+      if (exponent <= 0)
+        {
+          // Subnormal, or too small for a half altogether
+          if (exponent < -10)
+            return sign;
+          mantissa |= 0x800000;
+          shift = 14 - exponent;
+          half = mantissa >> shift;
+        }
+
+      const uint32_t rest = mantissa & ((1u << shift) - 1);
+      const uint32_t middle = 1u << (shift - 1);
+      if (rest > middle || (rest == middle && (half & 1)))
+        half++;
+      return sign | half;
+    }
+
+  static float
+  half_to_float(const uint16_t half)
+    {
+      const uint32_t sign = (half & 0x8000) << 16;
+      const uint32_t exponent = (half >> 10) & 0x1f;
+      const uint32_t mantissa = half & 0x3ff;
+
+      uint32_t x;
+      if (exponent == 0)
+        {
+          const float value = ldexp((float) mantissa, -24);
+          return sign ? -value : value;
+        }
+      else if (exponent == 31)
+        x = sign | 0x7f800000 | (mantissa << 13);
+      else
+        x = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+
+      float value;
+      memcpy(&value, &x, sizeof(value));
+      return value;
+    }
+
+  int
+  write_binary_design(ostream &out,
+                      const vector<int> &path,
+                      const vector<double> &scores,
+                      const int k,
+                      const double frame_size,
+                      const double weight,
+                      const bool white_thread,
+                      const score_encoding encoding)
+    {
+      if (k < 1 || k > 65536)
+        return 1;
+
+      // The pin opposite the previous one predicts the next.
+      vector<unsigned char> varint;
+      int previous = 0;
+      for (unsigned int i=0; i<path.size(); ++i)
+        {
+          int delta = (path[i] - previous - (i ? k/2 : 0)) % k;
+          if (delta < 0)
+            delta += k;
+          if (delta > k/2)
+            delta -= k;
+          uint32_t zigzag = delta < 0 ? 2*(uint32_t)(-delta) - 1 : 2*(uint32_t) delta;
+          while (zigzag >= 0x80)
+            {
+              varint.push_back((zigzag & 0x7f) | 0x80);
+              zigzag >>= 7;
+            }
+          varint.push_back(zigzag);
+          previous = path[i];
+        }
+
+      const pin_encoding pins =
+        (varint.size() < 2*path.size()) ? PINS_VARINT : PINS_UINT16;
+      const size_t n_scores = (encoding == NO_SCORES) ? 0
+        : min(scores.size(), path.empty() ? 0 : path.size()-1);
+
+      vector<unsigned char> data;
+      data.insert(data.end(), design_magic, design_magic+4);
+      put_u16(data, design_version);
+      data.push_back(pins);
+      data.push_back(encoding);
+      put_u32(data, k);
+      put_u32(data, path.size());
+      put_u32(data, n_scores);
+      put_u32(data, (pins == PINS_VARINT) ? varint.size() : 2*path.size());
+      put_u32(data, white_thread ? 1 : 0);
+      put_f32(data, frame_size);
+      put_f32(data, weight);
+      put_f32(data, get_length(path, k, frame_size));
+
+      if (pins == PINS_VARINT)
+        data.insert(data.end(), varint.begin(), varint.end());
+      else
+        for (unsigned int i=0; i<path.size(); ++i)
+          put_u16(data, path[i]);
+      while (data.size() % 4 != 0)
+        data.push_back(0);
+
+      for (unsigned int i=0; i<n_scores; ++i)
+        if (encoding == SCORES_FLOAT16)
+          put_u16(data, float_to_half(scores[i]));
+        else
+          put_f32(data, scores[i]);
+
+      out.write((const char*) data.data(), data.size());
+      return out.good() ? 0 : 1;
+    }
+
+  int
+  parse_binary_design(const void *data,
+                      const size_t size,
+                      design_view &view)
+    {
+      const unsigned char *bytes = (const unsigned char*) data;
+      if (size < design_header_bytes || memcmp(bytes, design_magic, 4) != 0)
+        return 1;
+
+      view.version = get_u16(bytes+4);
+      if (view.version != design_version || bytes[6] > PINS_VARINT
+          || bytes[7] > SCORES_FLOAT32)
+        return 1;
+
+      view.pins = (pin_encoding) bytes[6];
+      view.scores = (score_encoding) bytes[7];
+      view.k = get_u32(bytes+8);
+      view.n_pins = get_u32(bytes+12);
+      view.n_scores = get_u32(bytes+16);
+      view.pin_bytes = get_u32(bytes+20);
+      view.white_thread = get_u32(bytes+24) & 1;
+      view.frame_size = get_f32(bytes+28);
+      view.weight = get_f32(bytes+32);
+      view.length = get_f32(bytes+36);
+
+      const size_t score_offset =
+        (design_header_bytes + view.pin_bytes + 3) / 4 * 4;
+      const size_t score_size = (view.scores == NO_SCORES) ? 0
+        : (size_t) view.n_scores * (view.scores == SCORES_FLOAT16 ? 2 : 4);
+      // Every varint takes at least one byte, and there is at
+      // most one score per line.
+      if (view.k < 1 || view.k > 65536 || view.n_pins < 0 || view.n_scores < 0
+          || (view.pins == PINS_UINT16 && view.pin_bytes != 2*(size_t)view.n_pins)
+          || (view.pins == PINS_VARINT && (size_t) view.n_pins > view.pin_bytes)
+          || view.n_scores > max(view.n_pins-1, 0)
+          || score_offset + score_size > size)
+        return 1;
+
+      view.pin_data = bytes + design_header_bytes;
+      view.score_data = bytes + score_offset;
+      return 0;
+    }
+
+  int
+  decode_pins(const design_view &view,
+              vector<int> &path)
+    {
+      path.resize(view.n_pins);
+      if (view.pins == PINS_UINT16)
+        {
+          for (int i=0; i<view.n_pins; ++i)
+            {
+              path[i] = get_u16(view.pin_data + 2*i);
+              if (path[i] >= view.k)
+                return 1;
+            }
+          return 0;
+        }
+
+      const int k = view.k;
+      size_t pos = 0;
+      int previous = 0;
+      for (int i=0; i<view.n_pins; ++i)
+        {
+          uint32_t zigzag = 0;
+          for (int shift=0; ; shift+=7)
+            {
+              if (pos >= view.pin_bytes || shift > 28)
+                return 1;
+              const unsigned char byte = view.pin_data[pos++];
+              zigzag |= (uint32_t) (byte & 0x7f) << shift;
+              if (!(byte & 0x80))
+                break;
+            }
+          // Reduced mod k first, so that no garbage delta overflows
+          const int delta = (zigzag & 1) ? -(int) (((zigzag - 1) / 2 + 1) % k)
+                                         : (int) ((zigzag / 2) % k);
+          path[i] = ((previous + (i ? k/2 : 0) + delta) % k + k) % k;
+          previous = path[i];
+        }
+      return 0;
+    }
+
+  double
+  get_design_score(const design_view &view,
+                   const int i)
+    {
+      if (view.scores == SCORES_FLOAT16)
+        return half_to_float(get_u16(view.score_data + 2*i));
+      else if (view.scores == SCORES_FLOAT32)
+        return get_f32(view.score_data + 4*i);
+      return 0.0;
+    }
+
+  MappedDesign::MappedDesign()
+    : base(nullptr), size(0)
+    {}
+
+  MappedDesign::~MappedDesign()
+    {
+      close();
+    }
+
+  int
+  MappedDesign::open(const string &fname)
+    {
+      close();
+
+      const int fd = ::open(fname.c_str(), O_RDONLY);
+      if (fd < 0)
+        return 1;
+
+      struct stat info;
+      if (fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+          ::close(fd);
+          return 1;
+        }
+
+      void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (mapped == MAP_FAILED)
+        return 1;
+
+      base = mapped;
+      size = info.st_size;
+      if (parse_binary_design(base, size, parsed) != 0)
+        {
+          close();
+          return 1;
+        }
+      return 0;
+    }
+
+  void
+  MappedDesign::close()
+    {
+      if (base != nullptr)
+        munmap(base, size);
+      base = nullptr;
+      size = 0;
+    }
+
+  template <int channels>
+  inline
+  int
+  gather_channels(const vector<int> &line,
+                  const double *residual,
+                  double *sums)
+    {
+      double acc[channels] = {};
+      int pos=0;
+      for (; line[pos] != -1; pos++)
+        {
+          const double *pixel = residual + channels*line[pos];
+          for (int c=0; c<channels; ++c)
+            acc[c] += pixel[c];
+        }
+      for (int c=0; c<channels; ++c)
+        sums[c] = acc[c];
+      return pos;
+    }
+
+  void
+  get_channel_scores(const int a,
+                     const int b,
+                     const int k,
+                     const int channels,
+                     const vector<double> &weights,
+                     const vector<double> &residual,
+                     const vector<vector<int>> &lines,
+                     double *scores)
+    {
+      const vector<int> &line = lines[a*k + b];
+      int pos;
+
+      // Fixed channel counts let the compiler keep all the
+      // accumulators in registers.
+      switch (channels)
+        {
+          case 1: pos = gather_channels<1>(line, &residual[0], scores); break;
+          case 3: pos = gather_channels<3>(line, &residual[0], scores); break;
+          case 4: pos = gather_channels<4>(line, &residual[0], scores); break;
+          default:
+            {
+              for (int c=0; c<channels; ++c)
+                scores[c] = 0.0;
+              pos = 0;
+              for (; line[pos] != -1; pos++)
+                {
+                  const double *pixel = &residual[channels*line[pos]];
+                  for (int c=0; c<channels; ++c)
+                    scores[c] += pixel[c];
+                }
+            }
+        }
+
+      for (int c=0; c<channels; ++c)
+        scores[c] = weights[c] * (2 * scores[c] - weights[c] * pos);
+    }
+
+  void
+  do_ravel_channels(const vector<vector<double>> &images,
+                    const vector<double> &weights,
+                    const int k,
+                    const int N,
+                    const vector<vector<int>> &lines,
+                    const channel_ordering ordering,
+                    vector<segment> &segments)
+    {
+      const int channels = images.size();
+      segments.clear();
+
+      if (ordering == INDEPENDENT)
+        {
+          // Channels never touch each other's residual, so each
+          // one is simply a monochrome ravel, run on its own
+          // thread against the shared masks. Their segments are
+          // laid in turns, one from each channel.
+          vector<vector<int>> paths(channels, vector<int>(N+1));
+          vector<vector<double>> scores(channels, vector<double>(N));
+          vector<thread> workers;
+          for (int c=0; c<channels; ++c)
+            workers.push_back(thread([&, c]()
+              {
+                do_ravel(images[c], weights[c], k, N, lines, paths[c], scores[c]);
+              }));
+          for (unsigned int c=0; c<workers.size(); ++c)
+            workers[c].join();
+
+          segments.reserve((size_t) N * channels);
+          for (int n=0; n<N; ++n)
+            for (int c=0; c<channels; ++c)
+              {
+                segment seg = { paths[c][n], paths[c][n+1], c, scores[c][n] };
+                segments.push_back(seg);
+              }
+          return;
+        }
+
+      const int pixels = images[0].size();
+
+      vector<double> visual_weights(channels);
+      for (int c=0; c<channels; ++c)
+        visual_weights[c] = get_visual_weight(weights[c]);
+
+      vector<double> residual(pixels * channels);
+      for (int loc=0; loc<pixels; ++loc)
+        for (int c=0; c<channels; ++c)
+          residual[loc*channels + c] = images[c][loc];
+
+      vector<int> path(N+1);
+      vector<double> pin_scores(channels);
+      segments.reserve(N);
 
       path[0] = 0;
       for (int path_size=1; path_size <= N; path_size++)
         {
           int previous_pin = path[path_size-1];
           int next_pin = (previous_pin+1)%k;
+          int next_channel = 0;
           double score = -1e20;
 
           for (int pin=0; pin<k; ++pin)
             {
-              bool recently_visited = false;
-
-              for (int n=1; (n < 3) && (n < path_size); ++n)
-                recently_visited |= (path[path_size-n] == pin);
-
-              if (recently_visited)
+              if (recently_visited(path, path_size, pin))
                 continue;
 
-              double pin_score = get_score(previous_pin, pin, k, visual_weight,
-                                           residual, lines);
-              if (pin_score > score)
-                {
-                  score = pin_score;
-                  next_pin = pin;
-                }
+              get_channel_scores(previous_pin, pin, k, channels,
+                                 visual_weights, residual, lines,
+                                 &pin_scores[0]);
+              for (int c=0; c<channels; ++c)
+                if (pin_scores[c] > score)
+                  {
+                    score = pin_scores[c];
+                    next_pin = pin;
+                    next_channel = c;
+                  }
             }
 
           path[path_size] = next_pin;
-          scores[path_size-1] = score;
+          segment seg = { previous_pin, next_pin, next_channel, score };
+          segments.push_back(seg);
 
           int line_idx = previous_pin*k + next_pin;
           for (int i=0; lines[line_idx][i] != -1; ++i)
-            residual[lines[line_idx][i]] -= visual_weight;
+            residual[channels*lines[line_idx][i] + next_channel]
+              -= visual_weights[next_channel];
         }
     }
 
+  double
+  get_error(const vector<double> &residual)
+    {
+      double sum = 0.0;
+      for (unsigned int i=0; i<residual.size(); ++i)
+        sum += residual[i] * residual[i];
+      return sqrt(sum / residual.size());
+    }
+
   double
   get_length(const vector<int> &path,
             const int k,
@@ -153,4 +1762,102 @@ namespace Raveler
         }
       return length;
     }
+
+  shared_ptr<const mask_set>
+  build_mask_set(const int k,
+                 const int res,
+                 const int oversample,
+                 const layout_type layout)
+    {
+      shared_ptr<mask_set> set = make_shared<mask_set>();
+      set->k = k;
+      set->res = res;
+      set->oversample = oversample;
+      make_layout(res, layout, set->layout);
+
+      fill_flat_masks(k, res, oversample, set->layout, set->lines);
+      return set;
+    }
+
+  Engine::Engine(const int k,
+                 const int res,
+                 const int oversample,
+                 const layout_type layout)
+    : masks(build_mask_set(k, res, oversample, layout))
+    {}
+
+  unique_ptr<Session>
+  Engine::start(const vector<double> &image,
+                const double weight) const
+    {
+      if ((int) image.size() != masks->res * masks->res)
+        return nullptr;
+
+      unique_ptr<Session> session(new Session(masks));
+      vector<double> stored;
+      to_layout(image, masks->layout, stored);
+      init_state(stored, weight, masks->k, masks->res, masks->oversample,
+                 session->current, masks->layout.type);
+      return session;
+    }
+
+  unique_ptr<Session>
+  Engine::start(const vector<double> &image,
+                const double weight,
+                const ravel_state &previous,
+                const double tolerance) const
+    {
+      unique_ptr<Session> session = start(image, weight);
+      // A previous path from another configuration can't be replayed
+      if (session && previous.k == masks->k && previous.res == masks->res
+          && previous.oversample == masks->oversample
+          && previous.layout == masks->layout.type)
+        replay_prefix(session->current, previous, masks->lines, tolerance);
+      return session;
+    }
+
+  unique_ptr<Session>
+  Engine::resume(const ravel_state &state) const
+    {
+      if (state.k != masks->k || state.res != masks->res
+          || state.oversample != masks->oversample
+          || state.layout != masks->layout.type
+          || (int) state.residual.size() != masks->layout.size)
+        return nullptr;
+
+      unique_ptr<Session> session(new Session(masks));
+      session->current = state;
+      return session;
+    }
+
+  Session::Session(const shared_ptr<const mask_set> &masks)
+    : masks(masks), cancelled(false)
+    {}
+
+  bool
+  Session::run(const int N,
+               const int checkpoint_every,
+               const function<void(const ravel_state&)> &checkpoint)
+    {
+      flat_lines line = { masks->lines };
+      return resume_with(current, N, line, checkpoint_every, checkpoint,
+                         &cancelled);
+    }
+
+  bool
+  Session::run(const int N,
+               const draft_options &draft,
+               const int checkpoint_every,
+               const function<void(const ravel_state&)> &checkpoint)
+    {
+      flat_lines line = { masks->lines };
+      return resume_with(current, N, line, checkpoint_every, checkpoint,
+                         &cancelled, &draft);
+    }
+
+  void
+  Session::cancel()
+    {
+      cancelled.store(true);
+    }
 }
\ No newline at end of file
@@ -0,0 +1,247 @@
+/*
+  Raveler
+  Copyright (C) 2021 Jonathan Perry-Houts
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "libraveler.h"
+#include "ravelbench.h"
+
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+int
+open_counter(const unsigned int type,
+             const unsigned long long config)
+  {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+
+void
+start_counters(counters &c)
+  {
+    c.cache_fd = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    c.tlb_fd = open_counter(PERF_TYPE_HW_CACHE,
+                            PERF_COUNT_HW_CACHE_DTLB
+                            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    const int fds[2] = { c.cache_fd, c.tlb_fd };
+    for (int n=0; n<2; ++n)
+      if (fds[n] >= 0)
+        {
+          ioctl(fds[n], PERF_EVENT_IOC_RESET, 0);
+          ioctl(fds[n], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    c.start = chrono::steady_clock::now();
+  }
+
+void
+stop_counters(counters &c)
+  {
+    c.seconds = chrono::duration<double>(chrono::steady_clock::now() - c.start).count();
+    int fds[2] = { c.cache_fd, c.tlb_fd };
+    long long *values[2] = { &c.cache_misses, &c.tlb_misses };
+    for (int n=0; n<2; ++n)
+      {
+        *values[n] = -1;
+        if (fds[n] < 0)
+          continue;
+        ioctl(fds[n], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fds[n], values[n], sizeof(long long)) != sizeof(long long))
+          *values[n] = -1;
+        close(fds[n]);
+      }
+  }
+
+void
+print_counter(const long long value)
+  {
+    if (value < 0)
+      cout << "\tn/a";
+    else
+      cout << "\t" << value;
+  }
+
+void
+synthetic_image(const int res,
+                vector<double> &image)
+  {
+    image.resize(res*res);
+    for (int j=0; j<res; ++j)
+      for (int i=0; i<res; ++i)
+        image[Raveler::ij_to_loc(i, j, res)] =
+          0.5 + 0.4 * sin(12.0*i/res) * cos(9.0*j/res);
+  }
+
+int
+bench_layouts(const int res,
+              const int k,
+              const int N)
+  {
+    vector<double> image;
+    synthetic_image(res, image);
+
+    const char* names[3] = { "row", "tiled", "morton" };
+    const Raveler::layout_type types[3] = { Raveler::ROW_MAJOR,
+                                            Raveler::TILED,
+                                            Raveler::MORTON };
+
+    cout << "#res=" << res << " k=" << k << " N=" << N << endl;
+    cout << "#layout\tpixels\tseconds\tcache_misses\tdtlb_misses" << endl;
+
+    for (int n=0; n<3; ++n)
+      {
+        Raveler::pixel_layout layout;
+        Raveler::make_layout(res, types[n], layout);
+        Raveler::flat_masks masks;
+        Raveler::fill_flat_masks(k, res, 1, layout, masks);
+
+        vector<double> stored;
+        Raveler::to_layout(image, layout, stored);
+
+        vector<int> path(N+1);
+        vector<double> scores(N);
+        counters c;
+        start_counters(c);
+        Raveler::do_ravel(stored, 0.1, k, N, masks, path, scores);
+        stop_counters(c);
+
+        cout << names[n] << "\t" << layout.size << "\t" << c.seconds;
+        print_counter(c.cache_misses);
+        print_counter(c.tlb_misses);
+        cout << endl;
+      }
+    return 0;
+  }
+
+void
+bench_masks(const int k,
+            const int res,
+            const int oversample,
+            const int N)
+  {
+    counters c;
+    start_counters(c);
+    const int max_line_length = (int) oversample * sqrt(2*res*res);
+    vector<vector<int>> lines(k*k, vector<int>(max_line_length, -1));
+    Raveler::fill_line_masks(k, res, oversample, lines);
+    stop_counters(c);
+    const double table_build = c.seconds;
+
+    start_counters(c);
+    Raveler::flat_masks masks;
+    Raveler::fill_flat_masks(k, res, oversample, masks);
+    stop_counters(c);
+    const double flat_build = c.seconds;
+
+    // Besides a typical image, a blank one and one that is
+    // dark only along the chord from pin 0 to pin 100, where
+    // the first moves decide which pins are excluded.
+    const char *image_names[3] = { "synthetic", "blank", "chord" };
+    vector<double> images[3];
+    synthetic_image(res, images[0]);
+    images[1].assign(res*res, 0.0);
+    images[2].assign(res*res, 0.0);
+    for (int i=0; lines[100][i] != -1; ++i)
+      images[2][lines[100][i]] = 1.0;
+
+    char config[64];
+    snprintf(config, sizeof(config), "%d/%d/%d", k, res, oversample);
+    for (int n=0; n<3; ++n)
+      {
+        vector<int> table_path(N+1);
+        vector<double> table_scores(N);
+        start_counters(c);
+        Raveler::do_ravel(images[n], 0.1, k, N, lines, table_path, table_scores);
+        stop_counters(c);
+        const counters table = c;
+
+        vector<int> path(N+1);
+        vector<double> scores(N);
+        start_counters(c);
+        Raveler::do_ravel(images[n], 0.1, k, N, masks, path, scores);
+        stop_counters(c);
+
+        cout << config << "\t" << image_names[n] << "\ttable\t"
+             << table_build << "\t" << table.seconds;
+        print_counter(table.cache_misses);
+        print_counter(table.tlb_misses);
+        cout << endl;
+        cout << config << "\t" << image_names[n] << "\tflat\t"
+             << flat_build << "\t" << c.seconds;
+        print_counter(c.cache_misses);
+        print_counter(c.tlb_misses);
+        cout << "\t" << table.seconds / c.seconds << "x"
+             << ((path == table_path && scores == table_scores) ? "" : "\tMISMATCH")
+             << endl;
+      }
+  }
+
+int
+bench_kernels(const int N)
+  {
+    cout << "#N=" << N << endl;
+    cout << "#config\timage\tmasks\tbuild_s\travel_s\tcache_misses\tdtlb_misses\tspeedup"
+         << endl;
+    bench_masks(300, 600, 1, N);
+    bench_masks(200, 400, 1, N);
+    bench_masks(250, 500, 1, N);
+    bench_masks(150, 300, 2, N);
+    return 0;
+  }
+
+int main(int argc, char* argv[])
+  {
+    string mode = (argc > 1) ? argv[1] : "";
+    int res = 1200, k = 200, N = 1000;
+    if (argc > 2)
+      sscanf(argv[2], "%d", &res);
+    if (argc > 3)
+      sscanf(argv[3], "%d", &k);
+    if (argc > 4)
+      sscanf(argv[4], "%d", &N);
+
+    if (mode == "layout")
+      return bench_layouts(res, k, N);
+    if (mode == "kernels")
+      {
+        // Configurations are fixed; the only argument is N
+        N = 3000;
+        if (argc > 2)
+          sscanf(argv[2], "%d", &N);
+        return bench_kernels(N);
+      }
+
+    cerr << "usage: ravelbench <MODE> [ARGS]\n\n"
+         << "modes:\n"
+         << "  layout   Compare residual memory layouts (default 1200 200 1000)\n"
+         << "  kernels  Compare flat masks against the mask table for a few\n"
+         << "           configurations (ravelbench kernels [N], default\n"
+         << "           N=3000)\n"
+         << endl;
+    return 1;
+  }
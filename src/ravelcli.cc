@@ -19,6 +19,19 @@
 #include "libraveler.h"
 #include "ravelcli.h"
 #include <sstream>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <cstdlib>
+#include <dirent.h>
+#include <future>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void
 print_help()
@@ -42,12 +55,102 @@ print_help()
               << "  --res,-r <RES>       Before processing, scale the input image to this pixel\n"
               << "                       size along its shortest axis (default: 600)\n"
               << "  --size,-s <SIZE>     Diameter of your frame in meters (default: 0.622)\n"
-              << "  --format,-f <FMT>    Output format. Can be any of csv|tsv|json|svg|tex|png|show\n"
-              << "                       (default: csv)\n"
+              << "  --format,-f <FMT>    Output format. Can be any of csv|tsv|json|svg|bin|tex|\n"
+              << "                       png|show (default: csv)\n"
+              << "  --bin-scores <ENC>   How the bin format stores scores: none|f16|f32\n"
+              << "                       (default: f16)\n"
+              << "  --convert <DESIGN>   Instead of raveling, read an existing csv|tsv|json|bin\n"
+              << "                       design and write it in the output format. Text\n"
+              << "                       designs take -k, -w, -s and -i from the command line\n"
               << "  --oversample,-x <X>  Effectively increase the input resolution by oversampling\n"
-              << "                       the image mask paths with factor 'X' (default: 1)\n\n"
+              << "                       the image mask paths with factor 'X' (default: 1)\n"
+              << "  --threads,-j <T>     Number of worker threads (default: all cores)\n"
+              << "  --layout <LAYOUT>    Memory layout of the residual image: row|tiled|morton\n"
+              << "                       Tiled and Z-order (morton) layouts are more cache\n"
+              << "                       friendly at high resolution (default: row)\n"
+              << "  --mask-cache <FILE>  Load line masks from FILE if it holds masks for the\n"
+              << "                       same pins, resolution, oversampling and layout;\n"
+              << "                       otherwise build them and save them there\n"
+              << "  --timings            Report how long each stage took on stderr\n\n"
+
+              << "mask compression:\n"
+              << "  --compress-masks <MODE>\n"
+              << "                       Store line masks once per symmetry class instead of\n"
+              << "                       once per pair of pins. MODE is rotate (one line per\n"
+              << "                       pin offset, rotated on the fly; approximate) or\n"
+              << "                       grid (quarter turns and mirrors of the pixel grid\n"
+              << "                       only, so nothing is resampled; needs a multiple of\n"
+              << "                       4 pins). Both change the design: neither reproduces\n"
+              << "                       the uncompressed masks exactly\n"
+              << "  --mask-deviation     Report memory use of the compressed masks and how\n"
+              << "                       far they deviate from direct rasterization, then quit\n\n"
+
+              << "animation:\n"
+              << "  --sequence <SOURCE>  Ravel a sequence of frames instead of one image.\n"
+              << "                       SOURCE is a directory of frames (taken in name\n"
+              << "                       order), or \"-\" for a stream of raw 8-bit RES x RES\n"
+              << "                       grayscale frames on stdin. Each frame is warm started\n"
+              << "                       from the previous frame's path, and one design per\n"
+              << "                       frame is written (json: one object per line; csv/tsv:\n"
+              << "                       with a frame column)\n"
+              << "  --warm-tolerance <T> Keep replaying the previous frame's lines while each\n"
+              << "                       scores at least T times its old score (default 0.9).\n"
+              << "                       0 keeps every line that still helps. 1 keeps lines\n"
+              << "                       that score at least as well as before, even where a\n"
+              << "                       fresh ravel would pick another pin. inf ravels each\n"
+              << "                       frame from scratch\n\n"
+
+              << "drafts:\n"
+              << "  --draft <F>          Quick draft: score only a random fraction F of the\n"
+              << "                       pins at each step (e.g. 0.25)\n"
+              << "  --draft-seed <S>     Random seed, for reproducible drafts (default: 0)\n"
+              << "  --draft-stratified   Sample one pin from each of F*K equal arcs of the\n"
+              << "                       frame instead of uniformly\n"
+              << "  --draft-keep <M>     Always rescore the M best pins of the previous\n"
+              << "                       step (default: 4)\n"
+              << "  --draft-tail <T>     Score every pin for the last T lines (default: 0)\n"
+              << "  --draft-compare      Also run the exhaustive search and report the\n"
+              << "                       speedup and error difference on stderr\n\n"
+
+              << "checkpoints:\n"
+              << "  --checkpoint <FILE>  Save the ravel state to FILE when finished, so that\n"
+              << "                       it can be resumed or extended later\n"
+              << "  --checkpoint-every <M>\n"
+              << "                       Also save the state every M lines along the way\n"
+              << "  --resume <FILE>      Continue from a saved ravel state instead of an\n"
+              << "                       input image. Pins, resolution, thread weight, frame\n"
+              << "                       size and thread color are taken from the saved\n"
+              << "                       state, overriding -k, -r, -x, -w, -s and -i.\n"
+              << "  --extend-to <N>      Total number of lines wanted when resuming a design\n"
+              << "                       (same as --num-lines)\n\n"
+
+              << "color:\n"
+              << "  --colors,-c <MODEL>  Ravel one thread per color channel. MODEL is either\n"
+              << "                       cmyk (for a white canvas) or rgb (for a black\n"
+              << "                       canvas). Raw stdin input is then read as RGB bytes.\n"
+              << "                       Output formats: csv|tsv|json|svg\n"
+              << "  --order <ORDER>      independent: one continuous path per color, with\n"
+              << "                       N lines each (default). Costs one monochrome ravel\n"
+              << "                       per color, run concurrently on separate cores\n"
+              << "                       interleaved: one shared path of N lines, each drawn\n"
+              << "                       in whichever color fits best. Scores every color\n"
+              << "                       for each line, so it costs about as much as\n"
+              << "                       independent does on a single core\n\n"
+
+              << "parameter sweep:\n"
+              << "  --sweep              Ravel every combination of the ranges below, print a\n"
+              << "                       table ranked by reconstruction error to stderr, and\n"
+              << "                       write the best design to the output. Honors\n"
+              << "                       --layout and --draft\n"
+              << "  --sweep-pins <LIST>  Comma separated list of pin counts (default: -k)\n"
+              << "  --sweep-lines <R>    Range of line counts (default: -n)\n"
+              << "  --sweep-weight <R>   Range of thread weights (default: -w)\n"
+              << "  --sweep-size <R>     Range of frame sizes (default: -s)\n"
+              << "                       Ranges are either START:STOP:STEP or a comma\n"
+              << "                       separated list of values.\n\n"
               << "<INPUT>                Source image. Can be any image format. Use \"-\"\n"
-              << "                       to read from stdin.\n"
+              << "                       to read raw 8-bit grayscale pixels from stdin (files\n"
+              << "                       ending in .gray are read the same way).\n"
               << endl;
   }
 
@@ -129,13 +232,15 @@ int
 load_image(const string &fname,
            vector<double> &pixels,
            const int res,
-           const bool white_thread)
+           const bool white_thread,
+           const bool color)
   {
     Magick::Image image;
     try
       {
         image.read(fname);
-        image.type(Magick::GrayscaleType);
+        if (!color)
+          image.type(Magick::GrayscaleType);
 
         Magick::Geometry size = image.size();
         size_t width = size.width(), height = size.height();
@@ -150,12 +255,13 @@ load_image(const string &fname,
           }
 
         image.resize(Magick::Geometry(res,res));
-        if (!white_thread)
+        if (!white_thread && !color)
           image.negate(true);
         // image.normalize();
         image.flip();
 
-        image.write(0, 0, res, res, "R", Magick::DoublePixel, &pixels[0]);
+        image.write(0, 0, res, res, color ? "RGB" : "R",
+                    Magick::DoublePixel, &pixels[0]);
       }
     catch(Magick::Exception &error_)
       {
@@ -166,75 +272,48 @@ load_image(const string &fname,
   }
 #endif
 
-int main(int argc, char* argv[])
+bool
+is_raw_file(const string &input)
   {
-#ifndef NOMAGICK
-    Magick::InitializeMagick(*argv);
-#endif
-
-    int k=300, N=6000, res=600, oversample = 1;
-    float weight = 100e-6, frame_size = 0.622;
-    string input = "";
-    string output = "-";
-    string format = "csv";
-    bool white_thread = false;
+    return input.size() > 5
+           && input.compare(input.size()-5, 5, ".gray") == 0;
+  }
 
-    int i=1;
-    for (; i < argc; ++i)
+int
+read_input(const string &input,
+           vector<double> &image,
+           int &res,
+           const bool white_thread,
+           const bool color)
+  {
+    const int depth = color ? 3 : 1;
+    const bool raw_file = is_raw_file(input);
+    if (input == "-" || (raw_file && !color))
       {
-        string arg(argv[i]);
-        if (arg == "-h" || arg == "--help")
+        ifstream file;
+        if (input != "-")
           {
-            print_help();
-            return 0;
+            file.open(input, ios::in | ios::binary);
+            if (!file)
+              {
+                cerr << "Unable to read " << input << endl;
+                return 1;
+              }
           }
-        else if (arg == "-i" || arg == "--invert")
-          white_thread = true;
-        else if (arg == "-k" || arg == "--num-pins")
-          sscanf(argv[++i], "%d", &k);
-        else if (arg == "-n" || arg == "--num-lines" || arg == "-N")
-          sscanf(argv[++i], "%d", &N);
-        else if (arg == "-w" || arg == "--weight")
-          sscanf(argv[++i], "%f", &weight);
-        else if (arg == "-r" || arg == "--res")
-          sscanf(argv[++i], "%d", &res);
-        else if (arg == "-s" || arg == "--size")
-          sscanf(argv[++i], "%f", &frame_size);
-        else if (arg == "-f" || arg == "--format")
-          format = argv[++i];
-        else if (arg == "-o" || arg == "--output")
-          output = argv[++i];
-        else if (arg == "-x" || arg == "--oversample")
-          sscanf(argv[++i], "%d", &oversample);
-        else
-          input = arg;
-      }
-
-    if (input == "")
-      {
-        cerr << "No source image specified.\n"
-            << "Use -h flag for usage info." << endl;
-        return 1;
-      }
-
-    vector<double> image;
-    if (input == "-")
-      {
-        vector<unsigned char> raw(istreambuf_iterator<char>(std::cin),
+        istream &in = (input == "-") ? std::cin : file;
+        vector<unsigned char> raw((istreambuf_iterator<char>(in)),
                                   istreambuf_iterator<char>());
-        res = (int) sqrt(raw.size());
+        res = (int) sqrt(raw.size() / depth);
 
         image.resize(raw.size());
         for (unsigned int i=0; i<raw.size(); ++i)
-          image[i] = 1.0 - raw[i]/255.0;
+          image[i] = color ? raw[i]/255.0 : 1.0 - raw[i]/255.0;
       }
     else
       {
 #ifndef NOMAGICK
-        image.resize(res*res);
-        int status = load_image(input, image, res, white_thread);
-        if (status != 0)
-          return status;
+        image.resize(res*res*depth);
+        return load_image(input, image, res, white_thread, color);
 #else
         cerr  << "Raveler was compiled without ImageMagick support "
               << "and therefore cannot process encoded image formats."
@@ -242,16 +321,63 @@ int main(int argc, char* argv[])
         return 2;
 #endif
       }
+    return 0;
+  }
 
-    const int max_line_length = (int) oversample * sqrt(2*res*res);
-    vector<vector<int>> lines(k*k, vector<int>(max_line_length, -1));
-    Raveler::fill_line_masks(k, res, oversample, lines);
-
-    vector<double> scores(N);
-    vector<int> path(N+1);
-    const double relative_weight = weight * res / frame_size / oversample;
-    Raveler::do_ravel(image, relative_weight, k, N, lines, path, scores);
+int
+split_channels(const vector<double> &rgb,
+               const string &colors,
+               vector<vector<double>> &channels,
+               vector<string> &names)
+  {
+    const int pixels = rgb.size() / 3;
+    if (colors == "rgb")
+      {
+        // Additive light on a dark canvas: each thread
+        // accounts directly for its own primary.
+        names = {"red", "green", "blue"};
+        channels.assign(3, vector<double>(pixels));
+        for (int loc=0; loc<pixels; ++loc)
+          for (int c=0; c<3; ++c)
+            channels[c][loc] = rgb[3*loc + c];
+      }
+    else if (colors == "cmyk")
+      {
+        // Subtractive ink on a white canvas. Black thread
+        // covers the common darkness of all three primaries,
+        // and cyan/magenta/yellow make up the remainder.
+        names = {"cyan", "magenta", "yellow", "black"};
+        channels.assign(4, vector<double>(pixels));
+        for (int loc=0; loc<pixels; ++loc)
+          {
+            const double r = rgb[3*loc], g = rgb[3*loc+1], b = rgb[3*loc+2];
+            const double black = 1.0 - max(r, max(g, b));
+            channels[0][loc] = 1.0 - r - black;
+            channels[1][loc] = 1.0 - g - black;
+            channels[2][loc] = 1.0 - b - black;
+            channels[3][loc] = black;
+          }
+      }
+    else
+      {
+        cerr << "Unknown color model: <" << colors << ">" << endl;
+        cerr << "  Should be one of: cmyk|rgb" << endl;
+        return 1;
+      }
+    return 0;
+  }
 
+int
+write_design(const string &output,
+             const string &format,
+             const vector<int> &path,
+             const vector<double> &scores,
+             const int k,
+             const double weight,
+             const double frame_size,
+             const bool white_thread,
+             const Raveler::score_encoding score_format)
+  {
     const double thread_length = Raveler::get_length(path, k, frame_size);
 
     // output data stream:
@@ -260,7 +386,7 @@ int main(int argc, char* argv[])
     if(output == "-" || format == "png" || format == "show") {
       buf = std::cout.rdbuf();
     } else {
-      of.open(output, ios::out);
+      of.open(output, format == "bin" ? ios::out | ios::binary : ios::out);
       buf = of.rdbuf();
     }
     std::ostream result(buf);
@@ -274,7 +400,8 @@ int main(int argc, char* argv[])
         for (unsigned int i=0; i<path.size(); ++i)
           {
             pair<double,double> xy = Raveler::pin_to_xy(path[i], k);
-            result << path[i]  << sep << scores[i] << sep
+            result << path[i]  << sep
+                  << (i < scores.size() ? scores[i] : 0.0) << sep
                   << xy.first << sep << xy.second << endl;
           }
       }
@@ -324,10 +451,10 @@ int main(int argc, char* argv[])
         }
 
         {
+          // Designs converted without scores have none
           result << "  \"scores\": [";
-          for (unsigned int i=0; i<scores.size()-1; ++i)
-              result << scores[i] << ",";
-          result << scores[scores.size()-1];
+          for (unsigned int i=0; i<scores.size(); ++i)
+              result << (i ? "," : "") << scores[i];
           result << "]," << endl;
         }
 
@@ -346,6 +473,11 @@ int main(int argc, char* argv[])
 
         result << "}" << endl;
       }
+    else if (format == "bin")
+      {
+        Raveler::write_binary_design(result, path, scores, k, frame_size,
+                                     weight, white_thread, score_format);
+      }
     else if (format == "tex")
       {
         result << path2latex(path, 5, k);
@@ -397,7 +529,225 @@ int main(int argc, char* argv[])
     else
       {
         cerr << "Unknown output type: <" << format << ">" << endl;
+        cerr << "  Should be one of: csv|tsv|svg|json|bin|tex|png|show" << endl;
+        return 1;
+      }
+
+    if(output != "-") {
+      of.close();
+    }
+
+    return 0;
+  }
+
+int
+read_design(const string &input,
+            vector<int> &path,
+            vector<double> &scores,
+            int &k,
+            double &weight,
+            double &frame_size,
+            bool &white_thread)
+  {
+    path.clear();
+    scores.clear();
+
+    ifstream file(input, ios::in | ios::binary);
+    if (!file)
+      {
+        cerr << "Unable to read " << input << endl;
+        return 1;
+      }
+    char magic[4] = {0, 0, 0, 0};
+    file.read(magic, 4);
+
+    if (string(magic, 4) == "RAVD")
+      {
+        file.close();
+        Raveler::MappedDesign mapped;
+        if (mapped.open(input) != 0
+            || Raveler::decode_pins(mapped.view(), path) != 0)
+          {
+            cerr << "Corrupt binary design " << input << endl;
+            return 1;
+          }
+        const Raveler::design_view &view = mapped.view();
+        scores.resize(view.n_scores);
+        for (int i=0; i<view.n_scores; ++i)
+          scores[i] = Raveler::get_design_score(view, i);
+        k = view.k;
+        weight = view.weight;
+        frame_size = view.frame_size;
+        white_thread = view.white_thread;
+        return 0;
+      }
+
+    file.seekg(0);
+    const string text((istreambuf_iterator<char>(file)),
+                      istreambuf_iterator<char>());
+
+    if (text.find_first_not_of(" \t\r\n") != string::npos
+        && text[text.find_first_not_of(" \t\r\n")] == '{')
+      {
+        // json: just the "pins" and "scores" arrays
+        for (const string key : {"\"pins\"", "\"scores\""})
+          {
+            const size_t start = text.find('[', text.find(key));
+            const size_t stop = text.find(']', start);
+            if (text.find(key) == string::npos || start == string::npos
+                || stop == string::npos)
+              continue;
+            stringstream values(text.substr(start+1, stop-start-1));
+            string value;
+            while (getline(values, value, ','))
+              if (key == "\"pins\"")
+                path.push_back(stoi(value));
+              else
+                scores.push_back(stod(value));
+          }
+      }
+    else
+      {
+        // csv/tsv: pin and score in the first two columns
+        stringstream lines(text);
+        string line;
+        while (getline(lines, line))
+          {
+            if (line.empty() || line[0] == '#')
+              continue;
+            replace(line.begin(), line.end(), ',', ' ');
+            stringstream row(line);
+            int pin;
+            double score;
+            if (row >> pin)
+              {
+                path.push_back(pin);
+                if (row >> score)
+                  scores.push_back(score);
+              }
+          }
+      }
+
+    if (path.empty())
+      {
+        cerr << "No design found in " << input << endl;
+        return 1;
+      }
+    // One score per line, not per pin
+    if (scores.size() >= path.size())
+      scores.resize(path.size()-1);
+    return 0;
+  }
+
+int
+write_channel_design(const string &output,
+                     const string &format,
+                     const vector<Raveler::segment> &segments,
+                     const vector<string> &names,
+                     const int k,
+                     const double weight,
+                     const double frame_size,
+                     const bool white_thread)
+  {
+    vector<double> lengths(names.size(), 0.0);
+    for (unsigned int i=0; i<segments.size(); ++i)
+      {
+        vector<int> chord = { segments[i].a, segments[i].b };
+        lengths[segments[i].channel] += Raveler::get_length(chord, k, frame_size);
+      }
+
+    streambuf* buf;
+    ofstream of;
+    if(output == "-") {
+      buf = std::cout.rdbuf();
+    } else {
+      of.open(output, ios::out);
+      buf = of.rdbuf();
+    }
+    std::ostream result(buf);
+
+    if (format == "tsv" || format == "csv")
+      {
+        string sep = (format == "csv") ? "," : "\t";
+        for (unsigned int c=0; c<names.size(); ++c)
+          result << "#" << names[c] << " thread length: " << lengths[c] << endl;
+        result << "#channel" << sep << "pin_a" << sep << "pin_b"
+               << sep << "score" << endl;
+        for (unsigned int i=0; i<segments.size(); ++i)
+          result << names[segments[i].channel] << sep
+                 << segments[i].a << sep << segments[i].b << sep
+                 << segments[i].score << endl;
+      }
+    else if (format == "svg")
+      {
+        const int i_frame_size = (int) (1000 * frame_size);
+        result << "<svg xmlns=\"http://www.w3.org/2000/svg\""
+          << " viewbox=\"0 0 " << i_frame_size << " " << i_frame_size << "\">"
+          << endl;
+
+        result << "  <rect"
+          << " width=\"" << i_frame_size << "\""
+          << " height=\"" << i_frame_size << "\""
+          << " fill=\""
+          << (white_thread ? "black" : "white")
+          << "\"/>" << endl;
+
+        double stroke_width = weight*1000;
+        for (unsigned int i=0; i<segments.size(); ++i)
+          {
+            pair<double,double> xy0 = Raveler::pin_to_xy(segments[i].a, k);
+            pair<double,double> xy1 = Raveler::pin_to_xy(segments[i].b, k);
+            result << "  <line stroke=\"" << names[segments[i].channel] << "\""
+              << " stroke-width=\"" << stroke_width << "\""
+              << " x1=\"" << i_frame_size * xy0.first  << "\""
+              << " y1=\"" << i_frame_size * (1.0 - xy0.second) << "\""
+              << " x2=\"" << i_frame_size * xy1.first  << "\""
+              << " y2=\"" << i_frame_size * (1.0 - xy1.second) << "\" />"
+              << endl;
+          }
+
+        result << "</svg>" << endl;
+      }
+    else if (format == "json")
+      {
+        result << "{" << std::endl;
+
+        {
+          result << "  \"channels\": [";
+          for (unsigned int c=0; c<names.size(); ++c)
+            result << (c ? "," : "") << "\"" << names[c] << "\"";
+          result << "]," << endl;
+        }
+
+        {
+          result << "  \"lengths\": [";
+          for (unsigned int c=0; c<lengths.size(); ++c)
+            result << (c ? "," : "") << lengths[c];
+          result << "]," << endl;
+        }
+
+        {
+          result << "  \"segments\": [";
+          for (unsigned int i=0; i<segments.size(); ++i)
+            result << (i ? "," : "") << "[" << segments[i].channel << ","
+                   << segments[i].a << "," << segments[i].b << "]";
+          result << "]," << endl;
+        }
+
+        {
+          result << "  \"scores\": [";
+          for (unsigned int i=0; i<segments.size(); ++i)
+            result << (i ? "," : "") << segments[i].score;
+          result << "]" << endl;
+        }
+
+        result << "}" << endl;
+      }
+    else
+      {
+        cerr << "Unknown output type for color designs: <" << format << ">" << endl;
         cerr << "  Should be one of: csv|tsv|svg|json" << endl;
+        return 1;
       }
 
     if(output != "-") {
@@ -406,3 +756,920 @@ int main(int argc, char* argv[])
 
     return 0;
   }
+
+int
+save_checkpoint(const string &fname,
+                const Raveler::ravel_state &state)
+  {
+    // Write next to the old checkpoint and swap it in, so that
+    // being killed mid-write never destroys the previous one.
+    const string tmp = fname + ".tmp";
+    {
+      ofstream out(tmp, ios::out | ios::binary);
+      if (Raveler::write_state(out, state) != 0)
+        {
+          cerr << "Unable to write checkpoint to " << tmp << endl;
+          return 1;
+        }
+    }
+    if (rename(tmp.c_str(), fname.c_str()) != 0)
+      {
+        cerr << "Unable to write checkpoint to " << fname << endl;
+        return 1;
+      }
+    return 0;
+  }
+
+int
+prepare_masks(const int k,
+              const int res,
+              const int oversample,
+              const Raveler::layout_type layout_type,
+              const string &compress,
+              const Raveler::mask_symmetry symmetry,
+              const string &cache,
+              ravel_masks &masks)
+  {
+    auto start = chrono::steady_clock::now();
+    masks.loaded = false;
+
+    int status = 0;
+    ifstream in;
+    if (cache != "")
+      in.open(cache, ios::in | ios::binary);
+    istream *cached = in.is_open() ? &in : nullptr;
+
+    // Freshly built masks go next to the cache and are swapped
+    // in once complete, as for checkpoints. Other processes may
+    // be building the same cache, so the name is unique.
+    string tmp = cache + ".XXXXXX";
+    ofstream out;
+    if (cache != "" && compress == "")
+      {
+        // mkstemp makes the file private, but a cache may be
+        // shared between users, so it gets the usual mode.
+        const int fd = mkstemp(&tmp[0]);
+        if (fd != -1)
+          {
+            const mode_t mask = umask(0);
+            umask(mask);
+            fchmod(fd, 0644 & ~mask);
+            close(fd);
+            out.open(tmp, ios::out | ios::binary);
+          }
+      }
+    ostream *save = out.is_open() ? &out : nullptr;
+
+    if (compress != "")
+      status = Raveler::fill_compressed_masks(k, res, oversample, symmetry,
+                                              masks.compressed);
+    else
+      {
+        masks.loaded = cached && Raveler::read_mask_cache(
+          *cached, k, res, oversample, layout_type, masks.flat) == 0;
+        if (!masks.loaded)
+          {
+            Raveler::pixel_layout layout;
+            Raveler::make_layout(res, layout_type, layout);
+            Raveler::fill_flat_masks(k, res, oversample, layout, masks.flat);
+            if (save)
+              Raveler::write_mask_cache(*save, masks.flat);
+          }
+      }
+
+    if (save)
+      {
+        const bool written = out.good();
+        out.close();
+        if (masks.loaded || !written
+            || rename(tmp.c_str(), cache.c_str()) != 0)
+          remove(tmp.c_str());
+        if (!masks.loaded && !written)
+          cerr << "Unable to write mask cache to " << cache << endl;
+      }
+
+    masks.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return status;
+  }
+
+int
+print_mask_deviation(const int k,
+                     const int res,
+                     const int oversample,
+                     const string &compress)
+  {
+    const Raveler::mask_symmetry symmetry =
+      (compress == "grid") ? Raveler::GRID : Raveler::ROTATE;
+
+    Raveler::compressed_masks compressed;
+    if (Raveler::fill_compressed_masks(k, res, oversample, symmetry, compressed) != 0)
+      {
+        cerr << "Grid mask compression needs a multiple of 4 pins." << endl;
+        return 1;
+      }
+
+    // The full table is only measured, never filled.
+    const int max_line_length = (int) oversample * sqrt(2*res*res);
+    const double full_bytes = (double) k*k * (max_line_length * sizeof(int)
+                                              + sizeof(vector<int>));
+    const double compressed_bytes = Raveler::mask_bytes(compressed);
+
+    Raveler::mask_deviation deviation;
+    Raveler::compare_masks(compressed, deviation);
+
+    cout << "#compression: " << compress << " (" << compressed.fold << "-fold)\n"
+         << "full table bytes:       " << full_bytes << "\n"
+         << "compressed bytes:       " << compressed_bytes << "\n"
+         << "reduction:              " << full_bytes / compressed_bytes << "x\n"
+         << "identical lines:        " << deviation.identical << "\n"
+         << "mean pixel overlap:     " << deviation.overlap << "\n"
+         << "pixels within 1px:      " << deviation.adjacent << "\n"
+         << "mean length difference: " << deviation.length_error << endl;
+    return 0;
+  }
+
+/*
+ * Frames waiting to be raveled. The decoder thread pushes,
+ * the ravel thread pops; at most 'capacity' frames are held
+ * so decoding runs just one frame ahead.
+ */
+struct
+frame_queue
+{
+  mutex lock;
+  condition_variable changed;
+  deque<vector<double>> frames;
+  unsigned int capacity = 2;
+  bool finished = false;
+
+  void
+  push(vector<double> &frame)
+    {
+      unique_lock<mutex> guard(lock);
+      changed.wait(guard, [this]() { return frames.size() < capacity; });
+      frames.push_back(vector<double>());
+      frames.back().swap(frame);
+      changed.notify_all();
+    }
+
+  void
+  finish()
+    {
+      unique_lock<mutex> guard(lock);
+      finished = true;
+      changed.notify_all();
+    }
+
+  bool
+  pop(vector<double> &frame)
+    {
+      unique_lock<mutex> guard(lock);
+      changed.wait(guard, [this]() { return !frames.empty() || finished; });
+      if (frames.empty())
+        return false;
+      frame.swap(frames.front());
+      frames.pop_front();
+      changed.notify_all();
+      return true;
+    }
+};
+
+int
+list_frames(const string &dirname,
+            vector<string> &files)
+  {
+    DIR *dir = opendir(dirname.c_str());
+    if (dir == NULL)
+      {
+        cerr << "Unable to open frame directory " << dirname << endl;
+        return 1;
+      }
+    for (struct dirent *entry = readdir(dir); entry != NULL; entry = readdir(dir))
+      if (entry->d_name[0] != '.')
+        files.push_back(dirname + "/" + entry->d_name);
+    closedir(dir);
+    sort(files.begin(), files.end());
+    return 0;
+  }
+
+int
+run_sequence(const string &source,
+             const string &output,
+             const string &format,
+             int res,
+             const int k,
+             const int N,
+             const int oversample,
+             const double weight,
+             const double frame_size,
+             const bool white_thread,
+             const double tolerance)
+  {
+    if (format != "json" && format != "csv" && format != "tsv")
+      {
+        cerr << "Unknown output type for sequences: <" << format << ">" << endl;
+        cerr << "  Should be one of: csv|tsv|json" << endl;
+        return 1;
+      }
+
+    vector<string> files;
+    if (source != "-" && list_frames(source, files) != 0)
+      return 1;
+
+    // Decode frames on their own thread, so that decoding the
+    // next frame overlaps raveling the current one.
+    frame_queue queue;
+    atomic<int> decode_status(0);
+    thread decoder([&]()
+      {
+        const size_t frame_pixels = (size_t) res*res;
+        for (unsigned int f=0; source == "-" || f < files.size(); ++f)
+          {
+            vector<double> frame;
+            if (source == "-")
+              {
+                vector<char> raw(frame_pixels);
+                if (!cin.read(&raw[0], frame_pixels))
+                  break;
+                frame.resize(frame_pixels);
+                for (size_t i=0; i<frame_pixels; ++i)
+                  frame[i] = 1.0 - (unsigned char) raw[i]/255.0;
+              }
+            else
+              {
+                int frame_res = res;
+                int status = read_input(files[f], frame, frame_res, white_thread, false);
+                if (status == 0 && frame_res != res)
+                  {
+                    cerr << "Frame " << files[f] << " is not " << res << "x" << res << endl;
+                    status = 1;
+                  }
+                if (status != 0)
+                  {
+                    decode_status = status;
+                    break;
+                  }
+              }
+            queue.push(frame);
+          }
+        queue.finish();
+      });
+
+    streambuf* buf;
+    ofstream of;
+    if(output == "-") {
+      buf = std::cout.rdbuf();
+    } else {
+      of.open(output, ios::out);
+      buf = of.rdbuf();
+    }
+    std::ostream result(buf);
+
+    if (format != "json")
+      {
+        string sep = (format == "csv") ? "," : "\t";
+        result << "#frame" << sep << "pin" << sep << "score" << endl;
+      }
+
+    const double relative_weight = weight * res / frame_size / oversample;
+    Raveler::Engine engine(k, res, oversample);
+
+    vector<double> frame;
+    Raveler::ravel_state previous = {};
+    for (int f=0; queue.pop(frame); ++f)
+      {
+        auto t0 = chrono::steady_clock::now();
+        unique_ptr<Raveler::Session> session =
+          engine.start(frame, relative_weight, previous, tolerance);
+        const int kept = session->state().path.size() - 1;
+        session->run(N);
+        auto t1 = chrono::steady_clock::now();
+
+        const vector<int> &path = session->state().path;
+        const vector<double> &scores = session->state().scores;
+        cerr << "frame " << f << ": kept " << kept << " of "
+             << previous.scores.size() << " lines, "
+             << chrono::duration<double>(t1 - t0).count() << " s" << endl;
+
+        if (format == "json")
+          {
+            // One design per line (JSON Lines)
+            result << "{\"frame\": " << f
+                   << ", \"kept\": " << kept
+                   << ", \"length\": " << Raveler::get_length(path, k, frame_size)
+                   << ", \"pins\": [";
+            for (unsigned int i=0; i<path.size(); ++i)
+              result << (i ? "," : "") << path[i];
+            result << "], \"scores\": [";
+            for (unsigned int i=0; i<scores.size(); ++i)
+              result << (i ? "," : "") << scores[i];
+            result << "]}" << endl;
+          }
+        else
+          {
+            string sep = (format == "csv") ? "," : "\t";
+            for (unsigned int i=0; i<path.size(); ++i)
+              result << f << sep << path[i] << sep
+                     << (i < scores.size() ? scores[i] : 0.0) << endl;
+          }
+
+        previous = session->state();
+      }
+
+    decoder.join();
+
+    if(output != "-") {
+      of.close();
+    }
+
+    return decode_status;
+  }
+
+vector<double>
+parse_range(const string &spec)
+  {
+    vector<double> values;
+    double start, stop, step;
+    if (sscanf(spec.c_str(), "%lf:%lf:%lf", &start, &stop, &step) == 3)
+      {
+        if (step <= 0)
+          step = stop - start + 1;
+        // Allow for some round-off in the last step
+        for (double v=start; v <= stop + 1e-9*fabs(step); v += step)
+          values.push_back(v);
+      }
+    else
+      {
+        std::stringstream ss(spec);
+        string item;
+        while (getline(ss, item, ','))
+          values.push_back(atof(item.c_str()));
+      }
+    return values;
+  }
+
+int
+run_sweep(const vector<double> &image,
+          const int res,
+          const int oversample,
+          const Raveler::layout_type layout,
+          const Raveler::draft_options &draft,
+          const vector<double> &ks,
+          const vector<double> &Ns,
+          const vector<double> &weights,
+          const vector<double> &frame_sizes,
+          const int num_threads,
+          vector<sweep_result> &results)
+  {
+    // Only the longest N of any (k, weight, size) combination needs
+    // to be raveled. Shorter designs are prefixes of the same path.
+    vector<int> snapshots;
+    for (unsigned int i=0; i<Ns.size(); ++i)
+      if (Ns[i] >= 1)
+        snapshots.push_back((int) round(Ns[i]));
+    sort(snapshots.begin(), snapshots.end());
+    snapshots.erase(unique(snapshots.begin(), snapshots.end()), snapshots.end());
+
+    if (snapshots.empty() || ks.empty() || weights.empty() || frame_sizes.empty())
+      {
+        cerr << "Empty sweep range." << endl;
+        return 1;
+      }
+
+    // k varies fastest, so that the first jobs handed out need
+    // different engines and their masks are built in parallel.
+    struct job { int k; double weight, frame_size; };
+    vector<job> jobs;
+    for (unsigned int b=0; b<weights.size(); ++b)
+      for (unsigned int c=0; c<frame_sizes.size(); ++c)
+        for (unsigned int a=0; a<ks.size(); ++a)
+          jobs.push_back({(int) round(ks[a]), weights[b], frame_sizes[c]});
+
+    // One engine per k, built by whichever worker needs it
+    // first. Its masks are shared read-only by every session
+    // raveling with that k.
+    struct engine_slot
+    {
+      once_flag built;
+      unique_ptr<Raveler::Engine> engine;
+    };
+    map<int, engine_slot> engines;
+    for (unsigned int j=0; j<jobs.size(); ++j)
+      engines[jobs[j].k];
+
+    results.assign(jobs.size() * snapshots.size(), sweep_result());
+    atomic<unsigned int> next_job(0);
+
+    auto worker = [&]()
+      {
+        for (unsigned int j=next_job++; j<jobs.size(); j=next_job++)
+          {
+            const job &params = jobs[j];
+            const double relative_weight = params.weight * res
+                                         / params.frame_size / oversample;
+
+            engine_slot &slot = engines.at(params.k);
+            call_once(slot.built, [&]()
+              {
+                slot.engine.reset(new Raveler::Engine(params.k, res,
+                                                      oversample, layout));
+              });
+
+            // Stop at each requested N along the way to the longest
+            unique_ptr<Raveler::Session> session =
+              slot.engine->start(image, relative_weight);
+            for (unsigned int s=0; s<snapshots.size(); ++s)
+              {
+                const int n = snapshots[s];
+                if (draft.fraction > 0)
+                  session->run(n, draft);
+                else
+                  session->run(n);
+                const Raveler::ravel_state &state = session->state();
+
+                sweep_result &r = results[j*snapshots.size() + s];
+                r.k = params.k;
+                r.N = n;
+                r.weight = params.weight;
+                r.frame_size = params.frame_size;
+                r.error = Raveler::get_error(state.residual);
+                r.path = state.path;
+                r.scores = state.scores;
+                r.length = Raveler::get_length(r.path, params.k,
+                                               params.frame_size);
+              }
+          }
+      };
+
+    vector<thread> workers;
+    for (int t=0; t<num_threads; ++t)
+      workers.push_back(thread(worker));
+    for (unsigned int t=0; t<workers.size(); ++t)
+      workers[t].join();
+
+    sort(results.begin(), results.end(),
+         [](const sweep_result &a, const sweep_result &b)
+           { return a.error < b.error; });
+
+    return 0;
+  }
+
+void
+print_sweep_summary(const vector<sweep_result> &results,
+                    ostream &out)
+  {
+    out << "#rank\tk\tN\tweight\tsize\terror\tlength" << endl;
+    for (unsigned int i=0; i<results.size(); ++i)
+      {
+        const sweep_result &r = results[i];
+        out << i+1 << "\t" << r.k << "\t" << r.N << "\t"
+            << r.weight << "\t" << r.frame_size << "\t"
+            << r.error << "\t" << r.length << endl;
+      }
+  }
+
+int main(int argc, char* argv[])
+  {
+#ifndef NOMAGICK
+    Magick::InitializeMagick(*argv);
+#endif
+
+    int k=300, N=6000, res=600, oversample = 1;
+    float weight = 100e-6, frame_size = 0.622;
+    string input = "";
+    string output = "-";
+    string format = "csv";
+    bool white_thread = false;
+    string colors = "";
+    string order = "independent";
+
+    bool sweep = false;
+    string sweep_pins = "", sweep_lines = "", sweep_weight = "", sweep_size = "";
+    int num_threads = thread::hardware_concurrency();
+
+    string layout_name = "row";
+    string sequence = "";
+    string convert = "", bin_scores = "f16";
+    string mask_cache = "";
+    bool timings = false;
+    double warm_tolerance = 0.9;
+    string compress = "";
+    bool mask_deviation = false;
+    string checkpoint = "", resume = "";
+
+    Raveler::draft_options draft;
+    draft.fraction = 0;
+    bool draft_compare = false;
+    int checkpoint_every = 0, extend_to = 0;
+
+    int i=1;
+    for (; i < argc; ++i)
+      {
+        string arg(argv[i]);
+        if (arg == "-h" || arg == "--help")
+          {
+            print_help();
+            return 0;
+          }
+        else if (arg == "-i" || arg == "--invert")
+          white_thread = true;
+        else if (arg == "-k" || arg == "--num-pins")
+          sscanf(argv[++i], "%d", &k);
+        else if (arg == "-n" || arg == "--num-lines" || arg == "-N")
+          sscanf(argv[++i], "%d", &N);
+        else if (arg == "-w" || arg == "--weight")
+          sscanf(argv[++i], "%f", &weight);
+        else if (arg == "-r" || arg == "--res")
+          sscanf(argv[++i], "%d", &res);
+        else if (arg == "-s" || arg == "--size")
+          sscanf(argv[++i], "%f", &frame_size);
+        else if (arg == "-f" || arg == "--format")
+          format = argv[++i];
+        else if (arg == "-o" || arg == "--output")
+          output = argv[++i];
+        else if (arg == "-x" || arg == "--oversample")
+          sscanf(argv[++i], "%d", &oversample);
+        else if (arg == "-c" || arg == "--colors")
+          colors = argv[++i];
+        else if (arg == "--order")
+          order = argv[++i];
+        else if (arg == "-j" || arg == "--threads")
+          sscanf(argv[++i], "%d", &num_threads);
+        else if (arg == "--layout")
+          layout_name = argv[++i];
+        else if (arg == "--compress-masks")
+          compress = argv[++i];
+        else if (arg == "--mask-deviation")
+          mask_deviation = true;
+        else if (arg == "--mask-cache")
+          mask_cache = argv[++i];
+        else if (arg == "--timings")
+          timings = true;
+        else if (arg == "--convert")
+          convert = argv[++i];
+        else if (arg == "--bin-scores")
+          bin_scores = argv[++i];
+        else if (arg == "--sequence")
+          sequence = argv[++i];
+        else if (arg == "--warm-tolerance")
+          sscanf(argv[++i], "%lf", &warm_tolerance);
+        else if (arg == "--draft")
+          sscanf(argv[++i], "%lf", &draft.fraction);
+        else if (arg == "--draft-seed")
+          sscanf(argv[++i], "%u", &draft.seed);
+        else if (arg == "--draft-stratified")
+          draft.stratified = true;
+        else if (arg == "--draft-keep")
+          sscanf(argv[++i], "%d", &draft.keep_top);
+        else if (arg == "--draft-tail")
+          sscanf(argv[++i], "%d", &draft.exhaustive_tail);
+        else if (arg == "--draft-compare")
+          draft_compare = true;
+        else if (arg == "--checkpoint")
+          checkpoint = argv[++i];
+        else if (arg == "--checkpoint-every")
+          sscanf(argv[++i], "%d", &checkpoint_every);
+        else if (arg == "--resume")
+          resume = argv[++i];
+        else if (arg == "--extend-to")
+          sscanf(argv[++i], "%d", &extend_to);
+        else if (arg == "--sweep")
+          sweep = true;
+        else if (arg == "--sweep-pins")
+          sweep_pins = argv[++i];
+        else if (arg == "--sweep-lines")
+          sweep_lines = argv[++i];
+        else if (arg == "--sweep-weight")
+          sweep_weight = argv[++i];
+        else if (arg == "--sweep-size")
+          sweep_size = argv[++i];
+        else
+          input = arg;
+      }
+
+    Raveler::mask_symmetry symmetry = Raveler::ROTATE;
+    if (compress == "grid")
+      symmetry = Raveler::GRID;
+    else if (compress != "" && compress != "rotate")
+      {
+        cerr << "Unknown mask compression: <" << compress << ">" << endl;
+        cerr << "  Should be one of: rotate|grid" << endl;
+        return 1;
+      }
+
+    Raveler::score_encoding score_format = Raveler::SCORES_FLOAT16;
+    if (bin_scores == "none")
+      score_format = Raveler::NO_SCORES;
+    else if (bin_scores == "f32")
+      score_format = Raveler::SCORES_FLOAT32;
+    else if (bin_scores != "f16")
+      {
+        cerr << "Unknown score encoding: <" << bin_scores << ">" << endl;
+        cerr << "  Should be one of: none|f16|f32" << endl;
+        return 1;
+      }
+
+    if (convert != "")
+      {
+        vector<int> path;
+        vector<double> scores;
+        double design_weight = weight, design_size = frame_size;
+        if (read_design(convert, path, scores, k, design_weight,
+                        design_size, white_thread) != 0)
+          return 1;
+        return write_design(output, format, path, scores, k, design_weight,
+                            design_size, white_thread, score_format);
+      }
+
+    if (mask_deviation)
+      return print_mask_deviation(k, res, oversample,
+                                  compress == "" ? "rotate" : compress);
+
+    if (sequence != "")
+      return run_sequence(sequence, output, format, res, k, N, oversample,
+                          weight, frame_size, white_thread, warm_tolerance);
+
+    if (input == "" && resume == "")
+      {
+        cerr << "No source image specified.\n"
+            << "Use -h flag for usage info." << endl;
+        return 1;
+      }
+
+    if (resume != "" && (sweep || colors != ""))
+      {
+        cerr << "--resume only applies to monochrome designs." << endl;
+        return 1;
+      }
+
+    if (num_threads < 1)
+      num_threads = 1;
+
+    if (extend_to > 0)
+      N = extend_to;
+
+    if (compress == "grid" && k%4 != 0)
+      {
+        cerr << "Grid mask compression needs a multiple of 4 pins." << endl;
+        return 1;
+      }
+
+    Raveler::layout_type layout_type;
+    if (layout_name == "row")
+      layout_type = Raveler::ROW_MAJOR;
+    else if (layout_name == "tiled")
+      layout_type = Raveler::TILED;
+    else if (layout_name == "morton")
+      layout_type = Raveler::MORTON;
+    else
+      {
+        cerr << "Unknown layout: <" << layout_name << ">" << endl;
+        cerr << "  Should be one of: row|tiled|morton" << endl;
+        return 1;
+      }
+
+    if (draft.fraction > 0 && compress != "")
+      {
+        cerr << "Draft mode does not support compressed masks." << endl;
+        return 1;
+      }
+
+    if (compress != "" && layout_type != Raveler::ROW_MAJOR)
+      {
+        cerr << "Compressed masks only support the row layout." << endl;
+        return 1;
+      }
+
+    if (sweep && (compress != "" || mask_cache != "" || checkpoint != ""
+                  || draft_compare))
+      {
+        cerr << "--sweep does not support compressed masks, mask caches,"
+             << " checkpoints or draft comparison." << endl;
+        return 1;
+      }
+
+    if (compress != "" && mask_cache != "")
+      {
+        cerr << "The mask cache does not hold compressed masks." << endl;
+        return 1;
+      }
+
+    const auto start = chrono::steady_clock::now();
+    int status;
+    vector<double> image;
+    Raveler::ravel_state state;
+    if (resume != "")
+      {
+        ifstream in(resume, ios::in | ios::binary);
+        if (Raveler::read_state(in, state) != 0)
+          {
+            cerr << "Unable to read ravel state from " << resume << endl;
+            return 1;
+          }
+        k = state.k;
+        res = state.res;
+        oversample = state.oversample;
+        layout_type = state.layout;
+        // Older states did not keep the design parameters
+        if (state.frame_size > 0)
+          {
+            weight = state.thread_weight;
+            frame_size = state.frame_size;
+            white_thread = state.white_thread;
+          }
+      }
+
+    // Masks only depend on the configuration, so a monochrome
+    // ravel gets them ready while the image is decoded. Raw
+    // input may turn out to be another size than -r says, in
+    // which case they are prepared again afterwards. The size
+    // of raw stdin is only known once it has been read, so its
+    // masks are not prepared ahead.
+    const bool mono = (colors == "" && !sweep);
+    const bool stdin_input = (resume == "" && input == "-");
+    struct stat raw_stat;
+    if (resume == "" && colors == "" && is_raw_file(input)
+        && stat(input.c_str(), &raw_stat) == 0)
+      res = (int) sqrt(raw_stat.st_size);
+    int mask_res = res;
+    ravel_masks masks;
+    future<int> masks_ready;
+    if (mono && !stdin_input)
+      masks_ready = async(launch::async, [&, mask_res]()
+        {
+          return prepare_masks(k, mask_res, oversample, layout_type, compress,
+                               symmetry, mask_cache, masks);
+        });
+
+    if (resume == "")
+      {
+        status = read_input(input, image, res, white_thread, colors != "");
+        if (status != 0)
+          return status;
+      }
+
+    const int max_line_length = (int) oversample * sqrt(2*res*res);
+    const double relative_weight = weight * res / frame_size / oversample;
+
+    if (colors != "")
+      {
+        vector<vector<double>> channels;
+        vector<string> names;
+        status = split_channels(image, colors, channels, names);
+        if (status != 0)
+          return status;
+
+        if (format != "csv" && format != "tsv" && format != "json"
+            && format != "svg")
+          {
+            cerr << "Unknown output type for color designs: <" << format << ">" << endl;
+            cerr << "  Should be one of: csv|tsv|json|svg" << endl;
+            return 1;
+          }
+
+        if (order != "independent" && order != "interleaved")
+          {
+            cerr << "Unknown path ordering: <" << order << ">" << endl;
+            cerr << "  Should be one of: independent|interleaved" << endl;
+            return 1;
+          }
+
+        vector<vector<int>> lines(k*k, vector<int>(max_line_length, -1));
+        Raveler::fill_line_masks(k, res, oversample, lines);
+
+        vector<Raveler::segment> segments;
+        Raveler::do_ravel_channels(channels,
+          vector<double>(channels.size(), relative_weight), k, N, lines,
+          order == "interleaved" ? Raveler::INTERLEAVED : Raveler::INDEPENDENT,
+          segments);
+
+        // rgb threads are drawn on a black canvas
+        return write_channel_design(output, format, segments, names,
+                                    k, weight, frame_size,
+                                    white_thread || colors == "rgb");
+      }
+
+    if (sweep)
+      {
+        vector<sweep_result> results;
+        status = run_sweep(image, res, oversample, layout_type, draft,
+          sweep_pins == "" ? vector<double>(1, k) : parse_range(sweep_pins),
+          sweep_lines == "" ? vector<double>(1, N) : parse_range(sweep_lines),
+          sweep_weight == "" ? vector<double>(1, weight) : parse_range(sweep_weight),
+          sweep_size == "" ? vector<double>(1, frame_size) : parse_range(sweep_size),
+          num_threads, results);
+        if (status != 0)
+          return status;
+
+        print_sweep_summary(results, cerr);
+
+        const sweep_result &best = results[0];
+        return write_design(output, format, best.path, best.scores,
+                            best.k, best.weight, best.frame_size, white_thread,
+                            score_format);
+      }
+
+    Raveler::pixel_layout layout;
+    Raveler::make_layout(res, layout_type, layout);
+
+    if (resume == "")
+      {
+        vector<double> stored;
+        Raveler::to_layout(image, layout, stored);
+        Raveler::init_state(stored, relative_weight, k, res, oversample,
+                            state, layout_type);
+        state.thread_weight = weight;
+        state.frame_size = frame_size;
+        state.white_thread = white_thread;
+      }
+    else if ((int) state.residual.size() != layout.size
+             || (compress != "" && state.layout != Raveler::ROW_MAJOR))
+      {
+        cerr << "Ravel state in " << resume << " is inconsistent." << endl;
+        return 1;
+      }
+    const auto image_ready = chrono::steady_clock::now();
+
+    if (masks_ready.valid())
+      status = masks_ready.get();
+    else
+      {
+        mask_res = res;
+        status = prepare_masks(k, res, oversample, layout_type, compress,
+                               symmetry, mask_cache, masks);
+      }
+    const double mask_seconds = masks.seconds;
+    if (status == 0 && res != mask_res)
+      status = prepare_masks(k, res, oversample, layout_type, compress,
+                             symmetry, mask_cache, masks);
+    if (status != 0)
+      return status;
+    const auto masks_ready_at = chrono::steady_clock::now();
+
+    const Raveler::flat_masks &lines = masks.flat;
+    function<void(const Raveler::ravel_state&)> save = nullptr;
+    if (checkpoint != "")
+      save = [&checkpoint](const Raveler::ravel_state &snapshot)
+               { save_checkpoint(checkpoint, snapshot); };
+
+    if (draft.fraction > 0 && draft_compare)
+      {
+        // Time an exhaustive ravel of the same job for reference
+        Raveler::ravel_state exhaustive(state);
+        auto t0 = chrono::steady_clock::now();
+        Raveler::resume_ravel(exhaustive, N, lines);
+        auto t1 = chrono::steady_clock::now();
+        Raveler::resume_ravel(state, N, lines, draft, checkpoint_every, save);
+        auto t2 = chrono::steady_clock::now();
+
+        const double exhaustive_time = chrono::duration<double>(t1 - t0).count();
+        const double draft_time = chrono::duration<double>(t2 - t1).count();
+        const double exhaustive_error = Raveler::get_error(exhaustive.residual);
+        const double draft_error = Raveler::get_error(state.residual);
+        cerr << "exhaustive: " << exhaustive_time << " s, error "
+             << exhaustive_error << "\n"
+             << "draft:      " << draft_time << " s, error "
+             << draft_error << "\n"
+             << "speedup:    " << exhaustive_time / draft_time << "x\n"
+             << "error delta: " << draft_error - exhaustive_error
+             << " (" << 100.0 * (draft_error / exhaustive_error - 1.0) << "%)"
+             << endl;
+      }
+    else if (draft.fraction > 0)
+      Raveler::resume_ravel(state, N, lines, draft, checkpoint_every, save);
+    else if (compress == "")
+      Raveler::resume_ravel(state, N, lines, checkpoint_every, save);
+    else
+      Raveler::resume_ravel(state, N, masks.compressed, checkpoint_every, save);
+    const auto raveled = chrono::steady_clock::now();
+
+    if (checkpoint != "")
+      {
+        status = save_checkpoint(checkpoint, state);
+        if (status != 0)
+          return status;
+      }
+
+    status = write_design(output, format, state.path, state.scores,
+                          k, weight, frame_size, white_thread, score_format);
+
+    if (timings)
+      {
+        const auto done = chrono::steady_clock::now();
+        auto seconds = [](chrono::steady_clock::time_point from,
+                          chrono::steady_clock::time_point to)
+          { return chrono::duration<double>(to - from).count(); };
+        cerr << "image:  " << seconds(start, image_ready) << " s\n"
+             << "masks:  " << mask_seconds << " s"
+             << (masks.loaded ? " (from cache)" : "") << "\n";
+        if (res != mask_res)
+          cerr << "        input was " << res << "x" << res << ", not "
+               << mask_res << "x" << mask_res << "; prepared again in "
+               << masks.seconds << " s\n";
+        cerr << "wait:   " << seconds(image_ready, masks_ready_at) << " s\n"
+             << "ravel:  " << seconds(masks_ready_at, raveled) << " s\n"
+             << "write:  " << seconds(raveled, done) << " s\n"
+             << "total:  " << seconds(start, done) << " s" << endl;
+      }
+    return status;
+  }
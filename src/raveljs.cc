@@ -71,9 +71,8 @@ extern "C"
       design d;
       d.path.resize(N+1);
       d.scores.resize(N);
-      Raveler::do_ravel(image, weight*RES/frame_size/OVERSAMPLE,
-                        K, N, global.line_masks,
-                        d.path, d.scores);
+      Raveler::do_ravel(image, weight*RES/frame_size/OVERSAMPLE, K, N,
+                        global.masks, d.path, d.scores);
       d.length = Raveler::get_length(d.path, K, frame_size);
 
       const string result = design_to_json(d);
@@ -87,10 +86,7 @@ extern "C"
   int
   init()
     {
-      // Must allocate >= sqrt(2*RES2) elements for each line mask.
-      // About 850 in our case.
-      global.line_masks.resize(K2, vector<int>(OVERSAMPLE*850, -1));
-      Raveler::fill_line_masks(K, RES, OVERSAMPLE, global.line_masks);
+      Raveler::fill_flat_masks(K, RES, OVERSAMPLE, global.masks);
       return (int) global.pixel_buffer;
     }
 }
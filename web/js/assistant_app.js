@@ -103,7 +103,7 @@ async function init() {
     let uid = queryParams.get('design');
     design = JSON.parse(localStorage.getItem(uid));
   } else {
-    design = await fetch('web/design.json').then(res => res.json());
+    design = await fetchDesign('web/design.rvd');
   }
 
   if (!design || !design.pins) {
@@ -226,7 +226,7 @@ window.addEventListener("load", async () => {
   }
   img.src = 'web/volcano.jpg';
 
-  let design = await fetch('web/design.json').then(res => res.json());
+  let design = await fetchDesign('web/design.rvd');
   RAVELER.coords = pins2coords(design.pins, IMG_RES);
 
   let slider = document.getElementById('stop-slider');
@@ -46,6 +46,93 @@ function pins2coords(pins, scale) {
   });
 }
 
+function halfToFloat(half) {
+  let sign = (half & 0x8000) ? -1 : 1;
+  let exponent = (half >> 10) & 0x1f;
+  let mantissa = half & 0x3ff;
+  if (exponent == 0)
+    return sign * mantissa * Math.pow(2, -24);
+  if (exponent == 31)
+    return mantissa ? NaN : sign * Infinity;
+  return sign * (1 + mantissa/1024) * Math.pow(2, exponent - 15);
+}
+
+// Decode a binary design, as written by `raveler -f bin`
+// (see write_binary_design in libraveler.h).
+function decodeDesign(buffer) {
+  let view = new DataView(buffer);
+  let magic = String.fromCharCode(...new Uint8Array(buffer, 0, 4));
+  if (magic != "RAVD" || view.getUint16(4, true) != 1)
+    throw new Error("Not a raveler design");
+
+  let pinEncoding = view.getUint8(6);
+  let scoreEncoding = view.getUint8(7);
+  let k = view.getUint32(8, true);
+  let nPins = view.getUint32(12, true);
+  let nScores = view.getUint32(16, true);
+  let pinBytes = view.getUint32(20, true);
+
+  // Same checks as parse_binary_design, so that a corrupt file
+  // fails here instead of allocating or reading garbage
+  let offset = 40 + 4*Math.ceil(pinBytes/4);
+  let scoreSize = [0, 2, 4][scoreEncoding] * nScores;
+  if (pinEncoding > 1 || scoreEncoding > 2 || k < 1 || k > 65536
+      || (pinEncoding == 0 && pinBytes != 2*nPins)
+      || (pinEncoding == 1 && nPins > pinBytes)
+      || nScores > Math.max(nPins - 1, 0)
+      || offset + scoreSize > buffer.byteLength)
+    throw new Error("Corrupt raveler design");
+
+  let pins = new Array(nPins);
+  if (pinEncoding == 0) {
+    for (let i=0; i < nPins; i++) {
+      pins[i] = view.getUint16(40 + 2*i, true);
+      if (pins[i] >= k)
+        throw new Error("Corrupt raveler design");
+    }
+  } else {
+    // Zigzag varint deltas from the pin opposite the previous one
+    let pos = 40, previous = 0;
+    for (let i=0; i < nPins; i++) {
+      let zigzag = 0, shift = 0, byte;
+      do {
+        if (pos >= 40 + pinBytes || shift > 28)
+          throw new Error("Corrupt raveler design");
+        byte = view.getUint8(pos++);
+        zigzag += (byte & 0x7f) * Math.pow(2, shift);
+        shift += 7;
+      } while (byte & 0x80);
+      let delta = (zigzag % 2) ? -(zigzag + 1)/2 : zigzag/2;
+      let guess = previous + (i ? Math.floor(k/2) : 0);
+      pins[i] = (((guess + delta) % k) + k) % k;
+      previous = pins[i];
+    }
+  }
+
+  let scores = new Array(scoreEncoding ? nScores : 0);
+  for (let i=0; i < scores.length; i++) {
+    if (scoreEncoding == 1)
+      scores[i] = halfToFloat(view.getUint16(offset + 2*i, true));
+    else
+      scores[i] = view.getFloat32(offset + 4*i, true);
+  }
+
+  return {
+    k: k,
+    whiteThread: (view.getUint32(24, true) & 1) == 1,
+    frameSize: view.getFloat32(28, true),
+    weight: view.getFloat32(32, true),
+    length: view.getFloat32(36, true),
+    pins: pins,
+    scores: scores,
+  };
+}
+
+async function fetchDesign(url) {
+  let buffer = await fetch(url).then(res => res.arrayBuffer());
+  return decodeDesign(buffer);
+}
+
 function newUID() {
   while (true) {
     let uid = Math.random().toString(36).substring(2);